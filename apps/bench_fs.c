@@ -0,0 +1,449 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define bench_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Default size of the file read and written, in MiB */
+#define FILE_MIB 4
+/* Default number of rounds of the metadata and mount benchmarks */
+#define ROUNDS 5
+/* Files created by each round of the metadata benchmark */
+#define META_FILES 100
+/* Largest number of results */
+#define MAX_RESULTS 256
+
+/* Sizes of each fs_read() and fs_write() */
+static const size_t records[] = { 512, 4096, 16384, 131072 };
+#define NRECORDS (sizeof(records) / sizeof(records[0]))
+
+/* Offsets the transfers start at, aligned on a block or not */
+static const size_t offsets[] = { 0, 512 };
+#define NOFFSETS (sizeof(offsets) / sizeof(offsets[0]))
+
+/* Percentiles reported, in tenths of percent */
+static const int percentiles[] = { 500, 900, 990, 999 };
+#define NPERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+/* Measurements of one benchmark */
+struct result {
+	char name[16];
+	/* Size of each transfer and starting offset, 0 if not relevant */
+	size_t record, offset;
+	/* Size of the image in blocks (mount and umount only) */
+	size_t blocks;
+	/* Number of operations and bytes transferred */
+	size_t ops, bytes;
+	/* Total time spent in the operations */
+	double seconds;
+	/* Latencies in nanoseconds */
+	uint64_t mean, max, pct[NPERCENTILES];
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+
+/* Latency of each operation of the running benchmark */
+static uint64_t *samples;
+static size_t nsamples, max_samples;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sample(uint64_t start, size_t count)
+{
+	if (nsamples == max_samples) {
+		max_samples = max_samples ? 2 * max_samples : 4096;
+		samples = realloc(samples, max_samples * sizeof(*samples));
+		if (!samples)
+			die("Cannot allocate samples");
+	}
+	samples[nsamples++] = now_ns() - start;
+	results[nresults].bytes += count;
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Start a benchmark, whose operations are then timed with sample() */
+static struct result *begin(const char *name, size_t record, size_t offset)
+{
+	struct result *r;
+
+	if (nresults == MAX_RESULTS)
+		die("Too many results");
+
+	r = &results[nresults];
+	memset(r, 0, sizeof(*r));
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->record = record;
+	r->offset = offset;
+	nsamples = 0;
+
+	return r;
+}
+
+/* Finish the running benchmark and compute its statistics */
+static void end(void)
+{
+	struct result *r = &results[nresults++];
+	uint64_t total = 0;
+
+	if (!nsamples)
+		return;
+
+	qsort(samples, nsamples, sizeof(*samples), sample_cmp);
+	for (size_t i = 0; i < nsamples; i++)
+		total += samples[i];
+
+	r->ops = nsamples;
+	r->seconds = total / 1e9;
+	r->mean = total / nsamples;
+	r->max = samples[nsamples - 1];
+	for (size_t i = 0; i < NPERCENTILES; i++)
+		r->pct[i] = samples[(nsamples - 1) * percentiles[i] / 1000];
+}
+
+static int open_file(const char *filename)
+{
+	int fd = fs_open(filename);
+
+	if (fd < 0)
+		die("Cannot open '%s'", filename);
+	return fd;
+}
+
+static void seek(int fd, size_t offset)
+{
+	if (fs_lseek(fd, offset))
+		die("Cannot seek to %zu", offset);
+}
+
+/* Write or read @count bytes of @fd at its current offset, timed */
+static void timed_io(int fd, int write_op, void *buf, size_t count)
+{
+	uint64_t start = now_ns();
+	int ret = write_op ? fs_write(fd, buf, count) : fs_read(fd, buf, count);
+
+	if (ret != (int)count)
+		die("Cannot %s %zu bytes", write_op ? "write" : "read", count);
+	sample(start, count);
+}
+
+/* Go through @fd from @offset one record after the other */
+static void sequential(const char *name, int fd, int write_op, uint8_t *buf,
+		       size_t size, size_t record, size_t offset)
+{
+	begin(name, record, offset);
+	seek(fd, offset);
+	for (size_t pos = offset; pos + record <= size; pos += record)
+		timed_io(fd, write_op, buf, record);
+	end();
+}
+
+/* Access as many records of @fd as sequential() would, at random positions */
+static void random_access(const char *name, int fd, int write_op, uint8_t *buf,
+			  size_t size, size_t record, size_t offset)
+{
+	unsigned int rand_state = 1;
+	size_t count = (size - offset) / record;
+
+	begin(name, record, offset);
+	for (size_t i = 0; i < count; i++) {
+		size_t pos = offset + rand_r(&rand_state) % count * record;
+		uint64_t start = now_ns();
+
+		seek(fd, pos);
+		if ((write_op ? fs_write(fd, buf, record) :
+				fs_read(fd, buf, record)) != (int)record)
+			die("Cannot %s %zu bytes", write_op ? "write" : "read",
+			    record);
+		sample(start, record);
+	}
+	end();
+}
+
+static void bench_data(size_t size)
+{
+	uint8_t *buf = malloc(records[NRECORDS - 1]);
+	int fd;
+
+	if (!buf)
+		die("Cannot allocate buffer");
+	for (size_t i = 0; i < records[NRECORDS - 1]; i++)
+		buf[i] = i * 7;
+
+	/* Files that grow, one block allocation after the other */
+	for (size_t r = 0; r < NRECORDS; r++) {
+		if (fs_create("bench.append"))
+			die("Cannot create 'bench.append'");
+		fd = open_file("bench.append");
+		begin("append", records[r], 0);
+		for (size_t pos = 0; pos + records[r] <= size; pos += records[r])
+			timed_io(fd, 1, buf, records[r]);
+		end();
+		fs_close(fd);
+		if (fs_delete("bench.append"))
+			die("Cannot delete 'bench.append'");
+	}
+
+	/* Overwrites and reads of a file that already has its blocks */
+	if (fs_create("bench.data"))
+		die("Cannot create 'bench.data'");
+	fd = open_file("bench.data");
+	for (size_t pos = 0; pos < size; pos += records[NRECORDS - 1]) {
+		size_t len = size - pos < records[NRECORDS - 1] ?
+			     size - pos : records[NRECORDS - 1];
+
+		if (fs_write(fd, buf, len) != (int)len)
+			die("Cannot fill 'bench.data'");
+	}
+
+	for (size_t r = 0; r < NRECORDS; r++) {
+		for (size_t o = 0; o < NOFFSETS; o++) {
+			size_t record = records[r], offset = offsets[o];
+
+			sequential("seq_write", fd, 1, buf, size, record, offset);
+			sequential("seq_read", fd, 0, buf, size, record, offset);
+			random_access("rand_write", fd, 1, buf, size, record,
+				      offset);
+			random_access("rand_read", fd, 0, buf, size, record,
+				      offset);
+		}
+	}
+
+	fs_close(fd);
+	if (fs_delete("bench.data"))
+		die("Cannot delete 'bench.data'");
+	free(buf);
+}
+
+/* Operations of the metadata benchmark, all run in each pass */
+static const char *meta_ops[] = { "create", "open", "stat", "delete" };
+#define NMETA_OPS (sizeof(meta_ops) / sizeof(meta_ops[0]))
+
+static void bench_meta(int rounds)
+{
+	char filename[FS_FILENAME_LEN];
+	int fds[META_FILES];
+
+	/* One pass per operation, which is the only one timed */
+	for (size_t op = 0; op < NMETA_OPS; op++) {
+		begin(meta_ops[op], 0, 0);
+
+		for (int round = 0; round < rounds; round++) {
+			uint64_t start;
+
+			for (int i = 0; i < META_FILES; i++) {
+				snprintf(filename, sizeof(filename), "meta%d", i);
+				start = now_ns();
+				if (fs_create(filename))
+					die("Cannot create '%s'", filename);
+				if (op == 0)
+					sample(start, 0);
+			}
+
+			for (int i = 0; i < META_FILES; i++) {
+				snprintf(filename, sizeof(filename), "meta%d", i);
+				start = now_ns();
+				fds[i] = open_file(filename);
+				if (op == 1)
+					sample(start, 0);
+			}
+
+			for (int i = 0; i < META_FILES; i++) {
+				start = now_ns();
+				if (fs_stat(fds[i]) != 0)
+					die("Wrong size for 'meta%d'", i);
+				if (op == 2)
+					sample(start, 0);
+			}
+
+			for (int i = 0; i < META_FILES; i++)
+				fs_close(fds[i]);
+
+			for (int i = 0; i < META_FILES; i++) {
+				snprintf(filename, sizeof(filename), "meta%d", i);
+				start = now_ns();
+				if (fs_delete(filename))
+					die("Cannot delete '%s'", filename);
+				if (op == 3)
+					sample(start, 0);
+			}
+		}
+
+		end();
+	}
+}
+
+static void bench_mount(const char *diskname, int rounds)
+{
+	struct stat st;
+	size_t blocks;
+
+	if (stat(diskname, &st))
+		die("Cannot stat '%s'", diskname);
+	blocks = st.st_size / 4096;
+
+	for (int op = 0; op < 2; op++) {
+		begin(op ? "umount" : "mount", 0, 0)->blocks = blocks;
+		for (int round = 0; round < rounds; round++) {
+			uint64_t start = now_ns();
+
+			if (fs_mount(diskname))
+				die("Cannot mount '%s'", diskname);
+			if (!op)
+				sample(start, 0);
+
+			start = now_ns();
+			if (fs_umount())
+				die("Cannot unmount '%s'", diskname);
+			if (op)
+				sample(start, 0);
+		}
+		end();
+	}
+}
+
+static void print_text(void)
+{
+	printf("%-10s %7s %6s %7s %8s %9s %9s %9s %9s %9s %9s %9s\n",
+	       "bench", "record", "offset", "blocks", "ops", "MB/s", "ops/s",
+	       "mean us", "p50 us", "p90 us", "p99 us", "p99.9 us");
+	for (int i = 0; i < nresults; i++) {
+		struct result *r = &results[i];
+
+		printf("%-10s %7zu %6zu %7zu %8zu %9.1f %9.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+		       r->name, r->record, r->offset, r->blocks, r->ops,
+		       r->seconds ? r->bytes / r->seconds / 1e6 : 0,
+		       r->seconds ? r->ops / r->seconds : 0, r->mean / 1e3,
+		       r->pct[0] / 1e3, r->pct[1] / 1e3, r->pct[2] / 1e3,
+		       r->pct[3] / 1e3);
+	}
+}
+
+static void print_json(const char *diskname, size_t size, int cache,
+		       const char *backend)
+{
+	printf("{\n  \"disk\": \"%s\",\n  \"file_size\": %zu,\n", diskname, size);
+	if (cache < 0)
+		printf("  \"cache_blocks\": null,\n");
+	else
+		printf("  \"cache_blocks\": %d,\n", cache);
+	printf("  \"backend\": \"%s\",\n", backend);
+	printf("  \"results\": [\n");
+	for (int i = 0; i < nresults; i++) {
+		struct result *r = &results[i];
+
+		printf("    {\"bench\": \"%s\", \"record\": %zu, \"offset\": %zu, "
+		       "\"blocks\": %zu, \"ops\": %zu, \"bytes\": %zu, "
+		       "\"seconds\": %.6f, \"latency_ns\": {\"mean\": %lu, ",
+		       r->name, r->record, r->offset, r->blocks, r->ops,
+		       r->bytes, r->seconds, (unsigned long)r->mean);
+		for (size_t p = 0; p < NPERCENTILES; p++)
+			printf("\"p%g\": %lu, ", percentiles[p] / 10.0,
+			       (unsigned long)r->pct[p]);
+		printf("\"max\": %lu}}%s\n", (unsigned long)r->max,
+		       i == nresults - 1 ? "" : ",");
+	}
+	printf("  ]\n}\n");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-j] [-s <MiB>] [-r <rounds>] [-c <cache blocks>] "
+		"[-b file|mmap|uring] <diskname> [<diskname>...]\n", prog);
+	fprintf(stderr, "  Reads, writes and metadata operations run on the first disk,\n"
+		"  which needs <MiB> of free space. Mount and umount times are\n"
+		"  measured on every disk.\n");
+	fprintf(stderr, "  -j  print the results as JSON\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = FILE_MIB << 20;
+	int rounds = ROUNDS, json = 0, cache = -1, backend = FS_BACKEND_FILE;
+	const char *backend_name = "file";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "js:r:c:b:")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		case 's':
+			size = (size_t)atoi(optarg) << 20;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'c':
+			cache = atoi(optarg);
+			break;
+		case 'b':
+			if (!strcmp(optarg, "file"))
+				backend = FS_BACKEND_FILE;
+			else if (!strcmp(optarg, "mmap"))
+				backend = FS_BACKEND_MMAP;
+			else if (!strcmp(optarg, "uring"))
+				backend = FS_BACKEND_URING;
+			else
+				usage(argv[0]);
+			backend_name = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || size < records[NRECORDS - 1] || rounds < 1)
+		usage(argv[0]);
+
+	if (cache >= 0 && fs_cache_config(cache))
+		die("Cannot configure the cache");
+	if (fs_backend_config(backend))
+		die("Cannot configure the backend");
+	if (fs_open_config(META_FILES))
+		die("Cannot configure file descriptors");
+
+	if (fs_mount(argv[optind]))
+		die("Cannot mount '%s'", argv[optind]);
+	bench_data(size);
+	bench_meta(rounds);
+	if (fs_umount())
+		die("Cannot unmount '%s'", argv[optind]);
+
+	for (int i = optind; i < argc; i++)
+		bench_mount(argv[i], rounds * 4);
+
+	if (json)
+		print_json(argv[optind], size, cache, backend_name);
+	else
+		print_text();
+
+	free(samples);
+
+	return 0;
+}
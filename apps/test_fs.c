@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
@@ -7,8 +8,11 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -34,6 +38,59 @@ struct thread_arg {
 	char **argv;
 };
 
+/* Load the DATA or FILE argument of a script command, NULL if invalid */
+static char *script_data(const char *source, const char *description,
+			 int *size)
+{
+	struct stat st;
+	FILE *file;
+	char *data;
+
+	if (!source || !description)
+		return NULL;
+	if (strcmp(source, "DATA") == 0) {
+		*size = strlen(description);
+		return strdup(description);
+	}
+	if (strcmp(source, "FILE") != 0)
+		return NULL;
+
+	file = fopen(description, "r");
+	if (!file)
+		return NULL;
+	if (fstat(fileno(file), &st) || !S_ISREG(st.st_mode)) {
+		fclose(file);
+		return NULL;
+	}
+	data = calloc(st.st_size + 1, sizeof(char));
+	if (data && fread(data, sizeof(char), st.st_size, file) != (size_t)st.st_size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	*size = st.st_size;
+
+	return data;
+}
+
+/* Split the @size bytes of @buf into @iovcnt buffers of (about) the same size */
+static struct iovec *script_iov(char *buf, int size, int iovcnt)
+{
+	struct iovec *iov;
+	int i;
+
+	iov = calloc(iovcnt, sizeof(*iov));
+	if (!iov)
+		die_perror("calloc");
+	for (i = 0; i < iovcnt; i++) {
+		iov[i].iov_base = buf + i * (size / iovcnt);
+		iov[i].iov_len = size / iovcnt;
+	}
+	iov[iovcnt - 1].iov_len += size % iovcnt;
+
+	return iov;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -41,7 +98,7 @@ void thread_fs_script(void *arg)
 	char *diskname, *script;
 	FILE *fd_script;
 	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
+	const int total_command_parts = 5;
 	char *command_args[total_command_parts];
 	int offset;
 	char mounted = 0;
@@ -70,7 +127,7 @@ void thread_fs_script(void *arg)
 
 		do {
 			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
+		} while (command_args[command_index++] != NULL && command_index < total_command_parts);
 		command = command_args[0];
 
 		int data_fd;
@@ -148,6 +205,149 @@ void thread_fs_script(void *arg)
 				printf("SEEK successful.\n");
 			}
 
+		} else if (strcmp(command, "WRITEV") == 0) {
+			int iovcnt = atoi(command_args[1]);
+			struct iovec *iov;
+
+			data = script_data(command_args[2], command_args[3], &data_size);
+			if (!data || iovcnt <= 0) {
+				fs_umount();
+				die("Invalid data description");
+			}
+
+			iov = script_iov(data, data_size, iovcnt);
+			count = fs_writev(fs_fd, iov, iovcnt);
+			if (count < 0) {
+				fs_umount();
+				die("writev error");
+			}
+			printf("Wrote %d bytes to file from %d buffers.\n", count, iovcnt);
+
+			free(iov);
+			free(data);
+
+		} else if (strcmp(command, "READV") == 0) {
+			int read_req_length = atoi(command_args[1]);
+			int iovcnt = atoi(command_args[2]);
+			struct iovec *iov;
+
+			data = script_data(command_args[3], command_args[4], &data_size);
+			if (!data || iovcnt <= 0) {
+				fs_umount();
+				die("Invalid data description");
+			}
+
+			if (read_req_length < 0) {
+				fs_umount();
+				die("invalid data read length");
+			}
+
+			read_buf = calloc(read_req_length+1, sizeof(char));
+			iov = script_iov(read_buf, read_req_length, iovcnt);
+			count = fs_readv(fs_fd, iov, iovcnt);
+
+			if (count < 0) {
+				fs_umount();
+				die("readv error");
+			}
+
+			if (memcmp(data, read_buf, data_size+1) == 0)
+				printf("Read %d bytes from file into %d buffers. Compared %d correct.\n", count, iovcnt, data_size);
+			else
+				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+
+			free(iov);
+			free(read_buf);
+			free(data);
+
+		} else if (strcmp(command, "PWRITE") == 0) {
+			offset = atoi(command_args[1]);
+			data_source = command_args[2];
+			data = command_args[3];
+
+			if (strcmp(data_source, "DATA") != 0) {
+				fs_umount();
+				die("Invalid data description");
+			}
+
+			count = fs_pwrite(fs_fd, data, strlen(data), offset);
+			if (count < 0) {
+				fs_umount();
+				die("pwrite error");
+			}
+			printf("Wrote %d bytes to file at offset %d.\n", count, offset);
+
+		} else if (strcmp(command, "PREAD") == 0) {
+			offset = atoi(command_args[1]);
+			int read_req_length = atoi(command_args[2]);
+			data_source = command_args[3];
+			data = command_args[4];
+
+			if (strcmp(data_source, "DATA") != 0) {
+				fs_umount();
+				die("Invalid data description");
+			}
+
+			if (read_req_length < 0) {
+				fs_umount();
+				die("invalid data read length");
+			}
+
+			read_buf = calloc(read_req_length+1, sizeof(char));
+			count = fs_pread(fs_fd, read_buf, read_req_length, offset);
+
+			if (count < 0) {
+				fs_umount();
+				die("pread error");
+			}
+
+			data_size = strlen(data);
+			if (memcmp(data, read_buf, data_size+1) == 0)
+				printf("Read %d bytes from file at offset %d. Compared %d correct.\n", count, offset, data_size);
+			else
+				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+
+			free(read_buf);
+
+		} else if (strcmp(command, "STAT") == 0) {
+			count = fs_stat(fs_fd);
+
+			if (count < 0) {
+				fs_umount();
+				die("Cannot stat file");
+			}
+
+			printf("Size of file is %d bytes.\n", count);
+
+		} else if (strcmp(command, "TRUNCATE") == 0) {
+			if (fs_truncate(fs_fd, atoi(command_args[1]))) {
+				fs_umount();
+				die("Cannot truncate file");
+			}
+
+			printf("TRUNCATE successful.\n");
+
+		} else if (strcmp(command, "FALLOCATE") == 0) {
+			/* Running out of space is not fatal, it is what gets tested */
+			if (fs_fallocate(fs_fd, atoi(command_args[1])))
+				printf("FALLOCATE failed.\n");
+			else
+				printf("FALLOCATE successful.\n");
+
+		} else if (strcmp(command, "SYNC") == 0) {
+			if (fs_sync()) {
+				fs_umount();
+				die("Cannot sync");
+			}
+
+			printf("SYNC successful.\n");
+
+		} else if (strcmp(command, "CRASH") == 0) {
+			/* Leave without unmounting, as if the process crashed */
+			printf("CRASH successful.\n");
+			fflush(stdout);
+			_exit(0);
+
 		} else if (strcmp(command, "WRITE") == 0) {
 			data_source = command_args[1];
 			data_description = command_args[2];
@@ -370,6 +570,63 @@ void thread_fs_cat(void *arg)
 	free(buf);
 }
 
+/* Copy a file between two disks mounted at the same time */
+void thread_fs_copy(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *src_diskname, *dst_diskname, *filename;
+	fs_t *src, *dst;
+	char buf[BLOCK_SIZE];
+	int src_fd, dst_fd;
+	int stat, read, written = 0;
+
+	if (t_arg->argc < 3)
+		die("need <src diskname> <dst diskname> <filename>");
+
+	src_diskname = t_arg->argv[0];
+	dst_diskname = t_arg->argv[1];
+	filename = t_arg->argv[2];
+
+	src = fs_mount_ctx(src_diskname);
+	if (!src)
+		die("Cannot mount src diskname");
+	dst = fs_mount_ctx(dst_diskname);
+	if (!dst) {
+		fs_umount_ctx(src);
+		die("Cannot mount dst diskname");
+	}
+
+	src_fd = fs_open_ctx(src, filename);
+	if (src_fd < 0 || fs_create_ctx(dst, filename)) {
+		fs_umount_ctx(src);
+		fs_umount_ctx(dst);
+		die("Cannot open or create file");
+	}
+	dst_fd = fs_open_ctx(dst, filename);
+	stat = fs_stat_ctx(src, src_fd);
+
+	/* Alternate between the two instances, one block at a time */
+	while ((read = fs_read_ctx(src, src_fd, buf, sizeof(buf))) > 0) {
+		if (fs_write_ctx(dst, dst_fd, buf, read) != read) {
+			fs_umount_ctx(src);
+			fs_umount_ctx(dst);
+			die("Cannot write file");
+		}
+		written += read;
+	}
+
+	if (fs_close_ctx(src, src_fd) || fs_close_ctx(dst, dst_fd)) {
+		fs_umount_ctx(src);
+		fs_umount_ctx(dst);
+		die("Cannot close file");
+	}
+
+	if (fs_umount_ctx(src) || fs_umount_ctx(dst))
+		die("Cannot unmount diskname");
+
+	printf("Copied file '%s' (%d/%d bytes)\n", filename, written, stat);
+}
+
 void thread_fs_rm(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -458,6 +715,153 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+/* Host file imported by thread_fs_import(), mapped until the batch has run */
+struct import_file {
+	char *filename;
+	char *buf;
+	size_t size;
+};
+
+static void import_map(struct import_file **files, size_t *nfiles,
+		       const char *path, const char *filename)
+{
+	struct import_file *file;
+	struct stat st;
+	int fd;
+
+	*files = realloc(*files, (*nfiles + 1) * sizeof(**files));
+	if (!*files)
+		die_perror("realloc");
+	file = &(*files)[(*nfiles)++];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", path);
+
+	file->filename = strdup(filename);
+	if (!file->filename)
+		die_perror("strdup");
+	file->size = st.st_size;
+	file->buf = NULL;
+	if (file->size) {
+		file->buf = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (file->buf == MAP_FAILED)
+			die_perror("mmap");
+	}
+	close(fd);
+}
+
+static int import_cmp(const void *a, const void *b)
+{
+	const struct import_file *fa = a, *fb = b;
+
+	return strcmp(fa->filename, fb->filename);
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct import_file *files = NULL;
+	struct fs_batch_op *ops;
+	size_t nfiles = 0, nops = 0, failed = 0;
+	char *diskname;
+	int i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename or directory>...");
+
+	diskname = t_arg->argv[0];
+
+	/* Map all the host files, directories are imported file by file */
+	for (i = 1; i < t_arg->argc; i++) {
+		char *path = t_arg->argv[i];
+		struct dirent *ent;
+		struct stat st;
+		size_t first;
+		DIR *dir;
+
+		if (stat(path, &st))
+			die_perror("stat");
+		if (!S_ISDIR(st.st_mode)) {
+			import_map(&files, &nfiles, path, path);
+			continue;
+		}
+
+		dir = opendir(path);
+		if (!dir)
+			die_perror("opendir");
+		first = nfiles;
+		while ((ent = readdir(dir)) != NULL) {
+			char entry_path[PATH_MAX];
+
+			snprintf(entry_path, sizeof(entry_path), "%s/%s", path,
+				 ent->d_name);
+			if (stat(entry_path, &st) || !S_ISREG(st.st_mode))
+				continue;
+			import_map(&files, &nfiles, entry_path, ent->d_name);
+		}
+		closedir(dir);
+		qsort(files + first, nfiles - first, sizeof(*files), import_cmp);
+	}
+
+	/* One creation and one write per file, all in a single batch */
+	ops = calloc(2 * nfiles + 1, sizeof(*ops));
+	if (!ops)
+		die_perror("calloc");
+	for (size_t f = 0; f < nfiles; f++) {
+		ops[nops].op = FS_BATCH_CREATE;
+		ops[nops++].filename = files[f].filename;
+		if (!files[f].size)
+			continue;
+		ops[nops].op = FS_BATCH_WRITE;
+		ops[nops].filename = files[f].filename;
+		ops[nops].buf = files[f].buf;
+		ops[nops++].count = files[f].size;
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_batch(ops, nops)) {
+		fs_umount();
+		die("Cannot write batch");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	nops = 0;
+	for (size_t f = 0; f < nfiles; f++) {
+		int written = 0;
+
+		if (ops[nops++].ret) {
+			test_fs_error("Cannot create file '%s'", files[f].filename);
+			failed++;
+			if (files[f].size)
+				nops++;
+		} else {
+			if (files[f].size)
+				written = ops[nops++].ret;
+			printf("Wrote file '%s' (%d/%zu bytes)\n",
+			       files[f].filename, written, files[f].size);
+		}
+
+		if (files[f].size)
+			munmap(files[f].buf, files[f].size);
+		free(files[f].filename);
+	}
+	free(ops);
+	free(files);
+
+	printf("Imported %zu/%zu files\n", nfiles - failed, nfiles);
+	if (failed)
+		exit(1);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -504,6 +908,245 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+static void print_frag(void)
+{
+	struct fs_frag_stats stats;
+
+	if (fs_frag_stats(&stats)) {
+		fs_umount();
+		die("Cannot measure fragmentation");
+	}
+
+	printf("FS Frag:\n");
+	printf("files=%zu\n", stats.files);
+	printf("file_blk_count=%zu\n", stats.file_blocks);
+	printf("extents=%zu\n", stats.extents);
+	printf("avg_extent_blks=%.2f\n",
+	       stats.extents ? (double)stats.file_blocks / stats.extents : 0);
+	printf("extents_per_file=%.2f\n",
+	       stats.files ? (double)stats.extents / stats.files : 0);
+	printf("max_file_extents=%zu\n", stats.max_extents);
+	printf("free_blk_count=%zu\n", stats.free_blocks);
+	printf("free_runs=%zu\n", stats.free_runs);
+	printf("max_free_run=%zu\n", stats.max_free_run);
+	for (int i = 0; i < FS_FRAG_BUCKETS; i++) {
+		if (stats.free_hist[i])
+			printf("free_runs_%lu-%lu=%zu\n", 1UL << i,
+			       (2UL << i) - 1, stats.free_hist[i]);
+	}
+}
+
+void thread_fs_frag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	print_frag();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Defragment a file system, a budget of blocks or milliseconds per step */
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_defrag_stats stats;
+	size_t max_blocks = 0, moved = 0, extents;
+	unsigned int max_ms = 0;
+	int steps = 0, ret;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<max blocks per step> [<max ms per step>]]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		max_blocks = strtoul(t_arg->argv[1], NULL, 0);
+	if (t_arg->argc > 2)
+		max_ms = strtoul(t_arg->argv[2], NULL, 0);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	do {
+		ret = fs_defrag(max_blocks, max_ms, &stats);
+		if (ret < 0) {
+			fs_umount();
+			die("Cannot defragment");
+		}
+		if (!steps)
+			extents = stats.extents_before;
+		steps++;
+		moved += stats.blocks_moved;
+		printf("step %d: moved=%zu extents=%zu->%zu\n", steps,
+		       stats.blocks_moved, stats.extents_before,
+		       stats.extents_after);
+	} while (ret);
+
+	printf("FS Defrag:\n");
+	printf("steps=%d\n", steps);
+	printf("blocks_moved=%zu\n", moved);
+	printf("extents_before=%zu\n", extents);
+	printf("extents_after=%zu\n", stats.extents_after);
+	print_frag();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Block size of the file system */
+#define AGE_BLOCK 4096
+/* Largest write of the aging workload, in blocks, unless the disk needs more */
+#define AGE_MAX_WRITE 8
+/* Operations of the aging workload, out of 100, the rest are deletes */
+#define AGE_CREATE 15
+#define AGE_APPEND 55
+#define AGE_OVERWRITE 20
+
+/* Write up to @count bytes of @buf at @offset of @filename */
+static int age_write(const char *filename, char *buf, size_t offset,
+		     size_t count)
+{
+	int fs_fd, written;
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	if (fs_lseek(fs_fd, offset)) {
+		fs_umount();
+		die("Cannot seek file");
+	}
+	written = fs_write(fs_fd, buf, count);
+	fs_close(fs_fd);
+
+	return written;
+}
+
+void thread_fs_age(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+	size_t sizes[FS_FILE_MAX_COUNT];
+	size_t counts[4] = { 0 }, ops = 0, target, max_write;
+	unsigned int seed = 1, rand_state, next_name = 0;
+	struct fs_frag_stats stats;
+	int nfiles = 0, fill;
+	char *diskname, *buf;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <fill percentage> [<seed>]");
+
+	diskname = t_arg->argv[0];
+	fill = get_argv(t_arg->argv[1]);
+	if (fill < 1 || fill > 100)
+		die("Fill percentage must be between 1 and 100");
+	if (t_arg->argc > 2)
+		seed = get_argv(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Files already on the disk are left alone, only the fill level counts them */
+	if (fs_frag_stats(&stats)) {
+		fs_umount();
+		die("Cannot measure fragmentation");
+	}
+	target = (stats.file_blocks + stats.free_blocks) * fill / 100;
+
+	/*
+	 * Deletes are rarer than creates, so the directory fills up and files
+	 * keep growing. Writes get larger on large disks, so that the files of
+	 * a full directory can reach the target.
+	 */
+	max_write = target / 256 + 1;
+	if (max_write < AGE_MAX_WRITE)
+		max_write = AGE_MAX_WRITE;
+	max_write *= AGE_BLOCK;
+	buf = malloc(max_write);
+	if (!buf)
+		die_perror("malloc");
+	rand_state = seed;
+
+	/*
+	 * Files grow a few blocks at a time, interleaved with each other, and
+	 * some get deleted along the way, leaving holes behind
+	 */
+	while (stats.file_blocks < target && stats.free_blocks) {
+		int dice = rand_r(&rand_state) % 100;
+		int f = nfiles ? rand_r(&rand_state) % nfiles : 0;
+		size_t len = 1 + rand_r(&rand_state) % max_write;
+
+		for (size_t i = 0; i < len; i++)
+			buf[i] = 'a' + (ops + i) % 26;
+
+		if (!nfiles && stats.files == FS_FILE_MAX_COUNT) {
+			fs_umount();
+			die("Root directory is full");
+		}
+
+		if (!nfiles || (dice < AGE_CREATE &&
+				stats.files < FS_FILE_MAX_COUNT)) {
+			/* Skip the names of files left by a previous run */
+			snprintf(names[nfiles], FS_FILENAME_LEN, "age%u",
+				 next_name++);
+			if (fs_create(names[nfiles]))
+				continue;
+			sizes[nfiles++] = 0;
+			counts[0]++;
+		} else if (dice < AGE_CREATE + AGE_APPEND) {
+			sizes[f] += age_write(names[f], buf, sizes[f], len);
+			counts[1]++;
+		} else if (dice < AGE_CREATE + AGE_APPEND + AGE_OVERWRITE) {
+			size_t offset = sizes[f] ? rand_r(&rand_state) % sizes[f] : 0;
+
+			if (len > sizes[f] - offset)
+				len = sizes[f] - offset;
+			age_write(names[f], buf, offset, len);
+			counts[2]++;
+		} else {
+			if (fs_delete(names[f])) {
+				fs_umount();
+				die("Cannot delete file");
+			}
+			nfiles--;
+			memcpy(names[f], names[nfiles], FS_FILENAME_LEN);
+			sizes[f] = sizes[nfiles];
+			counts[3]++;
+		}
+
+		ops++;
+		if (fs_frag_stats(&stats)) {
+			fs_umount();
+			die("Cannot measure fragmentation");
+		}
+	}
+
+	printf("Aged '%s' with seed %u: %zu operations (%zu creates, "
+	       "%zu appends, %zu overwrites, %zu deletes)\n", diskname,
+	       seed, ops, counts[0], counts[1], counts[2], counts[3]);
+	print_frag();
+	free(buf);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_stats(void *arg);
+void thread_fs_trace(void *arg);
+void thread_fs_replay(void *arg);
+void thread_fs_journal(void *arg);
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -511,12 +1154,271 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "import",	thread_fs_import },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
+	{ "copy",	thread_fs_copy },
 	{ "stat",	thread_fs_stat },
+	{ "age",	thread_fs_age },
+	{ "frag",	thread_fs_frag },
+	{ "defrag",	thread_fs_defrag },
+	{ "stats",	thread_fs_stats },
+	{ "trace",	thread_fs_trace },
+	{ "replay",	thread_fs_replay },
+	{ "journal",	thread_fs_journal },
 	{ "script",	thread_fs_script }
 };
 
+/* Names of the operations counted by fs_get_stats() */
+static const char *op_names[FS_OP_COUNT] = {
+	[FS_OP_MOUNT] = "mount",
+	[FS_OP_UMOUNT] = "umount",
+	[FS_OP_CREATE] = "create",
+	[FS_OP_DELETE] = "delete",
+	[FS_OP_OPEN] = "open",
+	[FS_OP_LSEEK] = "lseek",
+	[FS_OP_READ] = "read",
+	[FS_OP_WRITE] = "write",
+};
+
+/* Run another command and print the counters of the operations it made */
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	struct fs_stats stats;
+	size_t i;
+
+	if (t_arg->argc < 1)
+		die("Usage: <command> [<arg>...]");
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(t_arg->argv[0], commands[i].name))
+			break;
+	}
+	if (i == ARRAY_SIZE(commands))
+		die("invalid command '%s'", t_arg->argv[0]);
+
+	cmd_arg.argc = t_arg->argc - 1;
+	cmd_arg.argv = &t_arg->argv[1];
+	fs_reset_stats();
+	commands[i].func(&cmd_arg);
+	fs_get_stats(&stats);
+
+	printf("FS Stats:\n");
+	for (int op = 0; op < FS_OP_COUNT; op++) {
+		struct fs_op_stats *o = &stats.ops[op];
+
+		if (!o->calls)
+			continue;
+		printf("%s: calls=%zu bytes=%zu blk_reads=%zu blk_writes=%zu "
+		       "avg_ns=%zu\n", op_names[op], o->calls, o->bytes,
+		       o->block_reads, o->block_writes, o->total_ns / o->calls);
+		for (int b = 0; b < FS_LATENCY_BUCKETS; b++) {
+			if (o->latency[b])
+				printf("\tlatency_ns_%lu-%lu=%zu\n", 1UL << b,
+				       (2UL << b) - 1, o->latency[b]);
+		}
+	}
+}
+
+/* Run another command and record the block requests it made in a trace */
+void thread_fs_trace(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	size_t i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <trace> <command> [<arg>...]");
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(t_arg->argv[1], commands[i].name))
+			break;
+	}
+	if (i == ARRAY_SIZE(commands))
+		die("invalid command '%s'", t_arg->argv[1]);
+
+	cmd_arg.argc = t_arg->argc - 2;
+	cmd_arg.argv = &t_arg->argv[2];
+	if (fs_trace_config(t_arg->argv[0]))
+		die("Cannot configure trace");
+	commands[i].func(&cmd_arg);
+	fs_trace_config(NULL);
+}
+
+/* Run another command on disks with a journal of the given configuration */
+void thread_fs_journal(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	size_t i;
+
+	if (t_arg->argc < 3)
+		die("Usage: <nblocks> <interval_ms> <command> [<arg>...]");
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(t_arg->argv[2], commands[i].name))
+			break;
+	}
+	if (i == ARRAY_SIZE(commands))
+		die("invalid command '%s'", t_arg->argv[2]);
+
+	cmd_arg.argc = t_arg->argc - 3;
+	cmd_arg.argv = &t_arg->argv[3];
+	if (fs_journal_config(atoi(t_arg->argv[0]), atoi(t_arg->argv[1])))
+		die("Cannot configure journal");
+	commands[i].func(&cmd_arg);
+}
+
+static uint64_t replay_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Load the records of trace file @filename, checking them against @bcount */
+static struct block_trace_record *replay_load(const char *filename,
+					      size_t bcount, size_t *nrecords)
+{
+	struct block_trace_header header;
+	struct block_trace_record *records = NULL;
+	size_t n = 0, size = 0;
+	FILE *file;
+
+	file = fopen(filename, "r");
+	if (!file)
+		die_perror("fopen");
+	if (fread(&header, sizeof(header), 1, file) != 1
+	    || header.magic != BLOCK_TRACE_MAGIC
+	    || header.record_size != sizeof(*records))
+		die("'%s' is not a block trace", filename);
+	if (header.block_count > bcount)
+		die("Trace of a %zu-block disk, disk has %zu blocks",
+		    (size_t)header.block_count, bcount);
+
+	for (;;) {
+		if (n == size) {
+			size = size ? 2 * size : 4096;
+			records = realloc(records, size * sizeof(*records));
+			if (!records)
+				die_perror("realloc");
+		}
+		if (fread(&records[n], sizeof(*records), 1, file) != 1)
+			break;
+		if (records[n].block + records[n].count > header.block_count)
+			die("Record %zu out of bounds", n);
+		n++;
+	}
+	if (ferror(file))
+		die_perror("fread");
+	fclose(file);
+
+	*nrecords = n;
+	return records;
+}
+
+/* Re-issue the block requests of a trace, as fast as possible or on time */
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	enum block_backend backend = BLOCK_BACKEND_FILE;
+	struct block_trace_record *records;
+	size_t nrecords, blocks[2] = { 0 }, tag_records[256] = { 0 };
+	size_t buf_blocks = 0;
+	uint64_t start, elapsed;
+	char *buf = NULL;
+	int timed = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <trace> [fast|timed] [file|mmap|uring]");
+
+	if (t_arg->argc > 2) {
+		if (!strcmp(t_arg->argv[2], "timed"))
+			timed = 1;
+		else if (strcmp(t_arg->argv[2], "fast"))
+			die("Invalid mode '%s'", t_arg->argv[2]);
+	}
+	if (t_arg->argc > 3) {
+		if (!strcmp(t_arg->argv[3], "mmap"))
+			backend = BLOCK_BACKEND_MMAP;
+		else if (!strcmp(t_arg->argv[3], "uring"))
+			backend = BLOCK_BACKEND_URING;
+		else if (strcmp(t_arg->argv[3], "file"))
+			die("Invalid backend '%s'", t_arg->argv[3]);
+	}
+
+	/* Writes overwrite the blocks with filler, replay against a copy */
+	if (block_disk_open_backend(t_arg->argv[0], backend))
+		die("Cannot open diskname");
+	records = replay_load(t_arg->argv[1], block_disk_count(), &nrecords);
+
+	start = replay_clock();
+	for (size_t i = 0; i < nrecords; i++) {
+		struct block_trace_record *rec = &records[i];
+		struct iovec iov;
+		int ret;
+
+		if (rec->count > buf_blocks) {
+			buf_blocks = rec->count;
+			buf = realloc(buf, buf_blocks * BLOCK_SIZE);
+			if (!buf)
+				die_perror("realloc");
+			memset(buf, 0xa5, buf_blocks * BLOCK_SIZE);
+		}
+
+		if (timed) {
+			uint64_t due = start + rec->time;
+			struct timespec ts = {
+				.tv_sec = due / 1000000000,
+				.tv_nsec = due % 1000000000,
+			};
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, NULL))
+				;
+		}
+
+		iov.iov_base = buf;
+		iov.iov_len = rec->count * BLOCK_SIZE;
+		if (rec->op == BLOCK_TRACE_WRITE)
+			ret = block_writev(rec->block, &iov, 1);
+		else
+			ret = block_readv(rec->block, &iov, 1);
+		if (ret)
+			die("Cannot replay record %zu", i);
+
+		blocks[rec->op == BLOCK_TRACE_WRITE] += rec->count;
+		tag_records[rec->tag]++;
+	}
+	elapsed = replay_clock() - start;
+
+	if (block_disk_close())
+		die("Cannot close diskname");
+
+	printf("Replay:\n");
+	printf("records=%zu\n", nrecords);
+	printf("blk_reads=%zu\n", blocks[0]);
+	printf("blk_writes=%zu\n", blocks[1]);
+	printf("elapsed_ms=%.3f\n", elapsed / 1e6);
+	printf("MB/s=%.1f\n", elapsed ? (blocks[0] + blocks[1]) * BLOCK_SIZE
+	       / (elapsed / 1e9) / 1e6 : 0);
+	for (int tag = 0; tag < 256; tag++) {
+		if (!tag_records[tag])
+			continue;
+		if (tag && tag <= FS_OP_COUNT)
+			printf("\t%s=%zu\n", op_names[tag - 1], tag_records[tag]);
+		else
+			printf("\ttag%d=%zu\n", tag, tag_records[tag]);
+	}
+
+	free(buf);
+	free(records);
+}
+
 void usage(char *program)
 {
 	size_t i;
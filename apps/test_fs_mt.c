@@ -0,0 +1,367 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of each test file */
+#define FILE_SIZE (512 * 1024)
+/* Size of each read or write */
+#define CHUNK_SIZE (16 * 1024)
+/* Number of times each reader goes through its file */
+#define READ_PASSES 8
+/* Largest number of threads measured by default */
+#define MAX_THREADS 8
+/* Smallest speedup of positional reads expected from using several processors */
+#define MIN_SPEEDUP 1.3
+
+struct thread_arg {
+	/* File accessed by the thread */
+	char filename[FS_FILENAME_LEN];
+	/* Descriptor shared with the other threads, for positional reads */
+	int fd;
+	/* Value the content of the file is derived from */
+	int seed;
+	/* Number of iterations */
+	int passes;
+	/* Bytes transferred */
+	size_t bytes;
+};
+
+/* Expected byte at @offset of a file written with @seed */
+static uint8_t pattern(int seed, size_t offset)
+{
+	return (uint8_t)(seed * 131 + offset * 7 + (offset >> 12));
+}
+
+static void fill(uint8_t *buf, int seed, size_t offset, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = pattern(seed, offset + i);
+}
+
+static void check(const uint8_t *buf, int seed, size_t offset, size_t len,
+		  const char *filename)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] != pattern(seed, offset + i))
+			die("'%s' corrupted at offset %zu", filename, offset + i);
+	}
+}
+
+static void create_file(const char *filename, int seed)
+{
+	uint8_t buf[CHUNK_SIZE];
+	int fd;
+
+	if (fs_create(filename))
+		die("Cannot create '%s'", filename);
+	if ((fd = fs_open(filename)) < 0)
+		die("Cannot open '%s'", filename);
+	for (size_t off = 0; off < FILE_SIZE; off += CHUNK_SIZE) {
+		fill(buf, seed, off, CHUNK_SIZE);
+		if (fs_write(fd, buf, CHUNK_SIZE) != CHUNK_SIZE)
+			die("Cannot write '%s'", filename);
+	}
+	fs_close(fd);
+}
+
+/* Read a whole file several times, through a descriptor of its own */
+static void *thread_read(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	uint8_t buf[CHUNK_SIZE];
+	int fd = fs_open(t_arg->filename);
+
+	if (fd < 0)
+		die("Cannot open '%s'", t_arg->filename);
+
+	for (int pass = 0; pass < t_arg->passes; pass++) {
+		size_t off = 0;
+		int n;
+
+		if (fs_lseek(fd, 0))
+			die("Cannot seek '%s'", t_arg->filename);
+		while ((n = fs_read(fd, buf, CHUNK_SIZE)) > 0) {
+			check(buf, t_arg->seed, off, n, t_arg->filename);
+			off += n;
+		}
+		if (off != FILE_SIZE)
+			die("Short read of '%s' (%zu bytes)", t_arg->filename, off);
+		t_arg->bytes += off;
+	}
+
+	fs_close(fd);
+
+	return NULL;
+}
+
+/* Read random chunks of a file through a descriptor shared by all the threads */
+static void *thread_pread(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	uint8_t buf[CHUNK_SIZE];
+	unsigned int rand_state = t_arg->seed + 1;
+	int count = t_arg->passes * FILE_SIZE / CHUNK_SIZE;
+
+	for (int i = 0; i < count; i++) {
+		size_t off = rand_r(&rand_state) % (FILE_SIZE - CHUNK_SIZE);
+
+		if (fs_pread(t_arg->fd, buf, CHUNK_SIZE, off) != CHUNK_SIZE)
+			die("Cannot read '%s'", t_arg->filename);
+		check(buf, 0, off, CHUNK_SIZE, t_arg->filename);
+		t_arg->bytes += CHUNK_SIZE;
+	}
+
+	return NULL;
+}
+
+/* Rewrite random chunks of a file and read them back */
+static void *thread_write(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	uint8_t buf[CHUNK_SIZE], rbuf[CHUNK_SIZE];
+	unsigned int rand_state = t_arg->seed;
+	int fd = fs_open(t_arg->filename);
+
+	if (fd < 0)
+		die("Cannot open '%s'", t_arg->filename);
+
+	for (int i = 0; i < t_arg->passes; i++) {
+		size_t off = rand_r(&rand_state) % (FILE_SIZE - CHUNK_SIZE);
+		size_t len = 1 + rand_r(&rand_state) % CHUNK_SIZE;
+
+		fill(buf, t_arg->seed, off, len);
+		if (fs_lseek(fd, off) || fs_write(fd, buf, len) != (int)len)
+			die("Cannot write '%s'", t_arg->filename);
+		if (fs_lseek(fd, off) || fs_read(fd, rbuf, len) != (int)len)
+			die("Cannot read '%s'", t_arg->filename);
+		check(rbuf, t_arg->seed, off, len, t_arg->filename);
+		t_arg->bytes += 2 * len;
+	}
+
+	fs_close(fd);
+
+	return NULL;
+}
+
+/* Create, fill and delete files of its own */
+static void *thread_churn(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	uint8_t buf[CHUNK_SIZE];
+
+	for (int i = 0; i < t_arg->passes; i++) {
+		int fd;
+
+		if (fs_create(t_arg->filename))
+			die("Cannot create '%s'", t_arg->filename);
+		if ((fd = fs_open(t_arg->filename)) < 0)
+			die("Cannot open '%s'", t_arg->filename);
+		fill(buf, t_arg->seed + i, 0, CHUNK_SIZE);
+		if (fs_write(fd, buf, CHUNK_SIZE) != CHUNK_SIZE)
+			die("Cannot write '%s'", t_arg->filename);
+		if (fs_stat(fd) != CHUNK_SIZE)
+			die("Wrong size for '%s'", t_arg->filename);
+		fs_close(fd);
+		if (fs_delete(t_arg->filename))
+			die("Cannot delete '%s'", t_arg->filename);
+		t_arg->bytes += CHUNK_SIZE;
+	}
+
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run @nthreads threads of @func, return the throughput in MB/s */
+static double run(void *(*func)(void *), struct thread_arg *args, int nthreads)
+{
+	pthread_t threads[MAX_THREADS * 2];
+	size_t bytes = 0;
+	double start = now();
+
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, func, &args[i]))
+			die("Cannot create thread");
+	}
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		bytes += args[i].bytes;
+	}
+
+	return bytes / (now() - start) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	struct thread_arg args[MAX_THREADS * 2];
+	pthread_t threads[MAX_THREADS * 2];
+	int max_threads = MAX_THREADS;
+	long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	double pread_single = 0, pread_best = 0;
+	int best_threads = 1;
+	int shared_fd;
+	char *diskname;
+
+	if (argc < 2)
+		die("Usage: %s <diskname> [<max threads>]", argv[0]);
+	diskname = argv[1];
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (max_threads < 1 || max_threads > MAX_THREADS)
+		die("Number of threads must be between 1 and %d", MAX_THREADS);
+
+	if (fs_open_config(4 * MAX_THREADS))
+		die("Cannot configure file descriptors");
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* One file shared by all the readers, and one file per thread */
+	create_file("shared", 0);
+	for (int i = 0; i < max_threads; i++) {
+		char filename[FS_FILENAME_LEN];
+
+		snprintf(filename, sizeof(filename), "private%d", i);
+		create_file(filename, i + 1);
+	}
+
+	/* Read throughput for an increasing number of threads */
+	if ((shared_fd = fs_open("shared")) < 0)
+		die("Cannot open 'shared'");
+	printf("threads\tshared MB/s\tprivate MB/s\tpread MB/s\n");
+	for (int n = 1; n <= max_threads; n *= 2) {
+		double shared, private, pread;
+
+		for (int i = 0; i < n; i++) {
+			memset(&args[i], 0, sizeof(args[i]));
+			strcpy(args[i].filename, "shared");
+			args[i].seed = 0;
+			args[i].passes = READ_PASSES;
+		}
+		shared = run(thread_read, args, n);
+
+		for (int i = 0; i < n; i++) {
+			memset(&args[i], 0, sizeof(args[i]));
+			snprintf(args[i].filename, FS_FILENAME_LEN, "private%d", i);
+			args[i].seed = i + 1;
+			args[i].passes = READ_PASSES;
+		}
+		private = run(thread_read, args, n);
+
+		for (int i = 0; i < n; i++) {
+			memset(&args[i], 0, sizeof(args[i]));
+			strcpy(args[i].filename, "shared");
+			args[i].fd = shared_fd;
+			args[i].seed = i;
+			args[i].passes = READ_PASSES;
+		}
+		pread = run(thread_pread, args, n);
+
+		printf("%d\t%.1f\t\t%.1f\t\t%.1f\n", n, shared, private, pread);
+
+		/* Only compare thread counts the processors can run in parallel */
+		if (n == 1)
+			pread_single = pread;
+		else if (n <= nprocs && pread > pread_best) {
+			pread_best = pread;
+			best_threads = n;
+		}
+	}
+	fs_close(shared_fd);
+
+	/* Readers of the same file must not wait for one another */
+	if (nprocs > 1 && max_threads > 1) {
+		double speedup = pread_best / pread_single;
+
+		printf("Read speedup: %.2fx with %d threads\n", speedup,
+		       best_threads);
+		if (speedup < MIN_SPEEDUP)
+			die("Reads do not scale (%.2fx, expected %.2fx)", speedup,
+			    MIN_SPEEDUP);
+	} else {
+		printf("Read speedup not checked on a single processor\n");
+	}
+
+	/* Readers, writers and directory updates all at once */
+	for (int i = 0; i < max_threads; i++) {
+		struct thread_arg *r = &args[i], *w = &args[max_threads + i];
+
+		memset(r, 0, sizeof(*r));
+		strcpy(r->filename, "shared");
+		r->passes = READ_PASSES;
+		if (pthread_create(&threads[i], NULL, thread_read, r))
+			die("Cannot create thread");
+
+		memset(w, 0, sizeof(*w));
+		if (i % 2) {
+			snprintf(w->filename, FS_FILENAME_LEN, "churn%d", i);
+			w->seed = 100 + i;
+			w->passes = 50;
+			if (pthread_create(&threads[max_threads + i], NULL,
+					   thread_churn, w))
+				die("Cannot create thread");
+		} else {
+			snprintf(w->filename, FS_FILENAME_LEN, "private%d", i);
+			w->seed = i + 1;
+			w->passes = 200;
+			if (pthread_create(&threads[max_threads + i], NULL,
+					   thread_write, w))
+				die("Cannot create thread");
+		}
+	}
+	for (int i = 0; i < 2 * max_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	/* Everything must have reached the disk */
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	for (int i = 0; i <= max_threads; i++) {
+		memset(&args[i], 0, sizeof(args[i]));
+		if (i == max_threads) {
+			strcpy(args[i].filename, "shared");
+			args[i].seed = 0;
+		} else {
+			snprintf(args[i].filename, FS_FILENAME_LEN, "private%d", i);
+			args[i].seed = i + 1;
+		}
+		args[i].passes = 1;
+		thread_read(&args[i]);
+	}
+	for (int i = 0; i < max_threads; i++) {
+		char filename[FS_FILENAME_LEN];
+
+		snprintf(filename, sizeof(filename), "churn%d", i);
+		if (fs_delete(filename) == 0)
+			die("'%s' was not deleted", filename);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Stress test passed\n");
+
+	return 0;
+}
@@ -237,6 +237,226 @@ run_fs_create_multiple() {
     log "Score: ${score}"
 }
 
+#
+# Instances
+#
+# copy between two disks mounted at once with test_fs.x, ls and cat with fs_ref.x
+run_fs_copy_ctx() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	run_tool ./fs_make.x test-copy.fs 20
+	run_tool dd if=/dev/urandom of=test-file-1 bs=1000 count=9
+	run_tool ./fs_ref.x add test.fs test-file-1
+	run_test ./test_fs.x copy test.fs test-copy.fs test-file-1
+	local copy="${STDOUT}"
+	run_test ./fs_ref.x ls test-copy.fs
+	local ls="${STDOUT}"
+	local same=$(./fs_ref.x cat test-copy.fs test-file-1 | tail -c 9000 |
+		cmp - test-file-1 && echo "Same content")
+	rm -f test.fs test-copy.fs test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${copy}" "1")")
+	line_array+=("$(select_line "${ls}" "2")")
+	line_array+=("${same}")
+	local corr_array=()
+	corr_array+=("Copied file 'test-file-1' (9000/9000 bytes)")
+	corr_array+=("file: test-file-1, size: 9000, data_blk: 1")
+	corr_array+=("Same content")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Vectored I/O
+#
+# writev and readv with test_fs.x across block boundaries, stat with fs_ref.x
+run_fs_writev_readv() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	run_tool dd if=/dev/urandom of=test-file bs=4096 count=3
+	head -c 4090 test-file > test-file-head
+	run_test ./test_fs.x script test.fs scripts/writev.script
+	local script="${STDOUT}"
+	run_test ./fs_ref.x stat test.fs file
+	local stat="${STDOUT}"
+	rm -f test.fs test-file test-file-head
+
+	local line_array=()
+	line_array+=("$(select_line "${script}" "4")")
+	line_array+=("$(select_line "${script}" "6")")
+	line_array+=("$(select_line "${script}" "8")")
+	line_array+=("$(select_line "${script}" "9")")
+	line_array+=("$(select_line "${stat}" "1")")
+	local corr_array=()
+	corr_array+=("Wrote 12288 bytes to file from 5 buffers.")
+	corr_array+=("Wrote 13 bytes to file from 3 buffers.")
+	corr_array+=("Read 4090 bytes from file into 7 buffers. Compared 4090 correct.")
+	corr_array+=("Read 13 bytes from file into 4 buffers. Compared 13 correct.")
+	corr_array+=("Size of file 'file' is 12288 bytes")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Positional I/O
+#
+# pwrite and pread with test_fs.x, mixed with write and read at the file offset
+run_fs_pwrite_pread() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	run_test ./test_fs.x script test.fs scripts/pwrite.script
+	local script="${STDOUT}"
+	run_test ./fs_ref.x cat test.fs file
+	local cat="${STDOUT}"
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${script}" "8")")
+	line_array+=("$(select_line "${script}" "9")")
+	line_array+=("$(select_line "${cat}" "3")")
+	local corr_array=()
+	corr_array+=("Read 13 bytes from file at offset 0. Compared 13 correct.")
+	corr_array+=("Read 1 bytes from file. Compared 1 correct.")
+	corr_array+=("01ab456789!!z")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Resizing
+#
+# fallocate, truncate and append with test_fs.x, info with fs_ref.x
+run_fs_fallocate_truncate() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	run_test ./test_fs.x script test.fs scripts/truncate.script
+	local script="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	local info="${STDOUT}"
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${script}" "5")")
+	line_array+=("$(select_line "${script}" "6")")
+	line_array+=("$(select_line "${script}" "9")")
+	line_array+=("$(select_line "${script}" "11")")
+	line_array+=("$(select_line "${info}" "7")")
+	local corr_array=()
+	corr_array+=("FALLOCATE failed.")
+	corr_array+=("FALLOCATE successful.")
+	corr_array+=("Size of file is 7 bytes.")
+	corr_array+=("Read 7 bytes from file. Compared 7 correct.")
+	corr_array+=("fat_free_ratio=8/10")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# fallocate more than the free space on a journaled disk, info with test_fs.x
+run_fs_fallocate_full() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 40
+	run_tool dd if=/dev/urandom of=test-file-1 bs=4096 count=10
+	run_test ./test_fs.x journal 16 0 info test.fs
+	local before="${STDOUT}"
+	run_test ./test_fs.x journal 16 0 script test.fs scripts/fallocate.script
+	local script="${STDOUT}"
+	run_test ./test_fs.x info test.fs
+	local after="${STDOUT}"
+	rm -f test.fs test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${before}" "7")")
+	line_array+=("$(select_line "${script}" "10")")
+	line_array+=("$(select_line "${script}" "11")")
+	line_array+=("$(select_line "${after}" "7")")
+	line_array+=("$(select_line "${after}" "8")")
+	local corr_array=()
+	corr_array+=("fat_free_ratio=23/40")
+	corr_array+=("FALLOCATE failed.")
+	corr_array+=("Size of file is 0 bytes.")
+	corr_array+=("fat_free_ratio=23/40")
+	corr_array+=("rdir_free_ratio=127/128")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Syncing
+#
+# sync with test_fs.x, crash before unmounting, ls and cat with fs_ref.x
+run_fs_sync_crash() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	run_tool ./test_fs.x script test.fs scripts/sync.script
+
+	run_test ./fs_ref.x info test.fs
+	local info="${STDOUT}"
+	run_test ./fs_ref.x cat test.fs kept
+	local cat="${STDOUT}"
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${info}" "7")")
+	line_array+=("$(select_line "${info}" "8")")
+	line_array+=("$(select_line "${cat}" "3")")
+	local corr_array=()
+	corr_array+=("fat_free_ratio=8/10")
+	corr_array+=("rdir_free_ratio=127/128")
+	corr_array+=("hello world")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# commit to the journal with test_fs.x, crash, replay by remounting
+run_fs_journal_replay() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x journal 16 0 script test.fs scripts/journal.script
+
+	run_test ./fs_ref.x info test.fs
+	local crashed="${STDOUT}"
+	run_test ./test_fs.x cat test.fs kept
+	local cat="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	local replayed="${STDOUT}"
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${crashed}" "8")")
+	line_array+=("$(select_line "${cat}" "3")")
+	line_array+=("$(select_line "${replayed}" "7")")
+	line_array+=("$(select_line "${replayed}" "8")")
+	local corr_array=()
+	corr_array+=("rdir_free_ratio=128/128")
+	corr_array+=("hello world")
+	corr_array+=("fat_free_ratio=82/100")
+	corr_array+=("rdir_free_ratio=127/128")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
 #
 # Run tests
 #
@@ -247,6 +467,18 @@ run_tests() {
 	# Phase 2
 	run_fs_simple_create
 	run_fs_create_multiple
+	# Instances
+	run_fs_copy_ctx
+	# Vectored I/O
+	run_fs_writev_readv
+	# Positional I/O
+	run_fs_pwrite_pread
+	# Resizing
+	run_fs_fallocate_truncate
+	run_fs_fallocate_full
+	# Syncing
+	run_fs_sync_crash
+	run_fs_journal_replay
 }
 
 make_fs() {
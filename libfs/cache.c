@@ -0,0 +1,798 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Maximum number of blocks written back along with an evicted block */
+#define CACHE_FLUSH_RUN 64
+
+/* Empty link in the LRU list, or block that is not cached */
+#define NO_SLOT -1
+
+/* Maximum number of consecutive blocks read ahead in one go */
+#define READAHEAD_RUN 16
+
+/* No staging slot holds the block */
+#define NO_STAGE -1
+
+/* States of a staging slot */
+enum stage_state {
+	STAGE_FREE,
+	/* Requested, waiting for the readahead thread */
+	STAGE_QUEUED,
+	/* Being read by the readahead thread */
+	STAGE_LOADING,
+	/* Read, waiting to be picked up by cache_read() */
+	STAGE_READY,
+};
+
+/* Block read ahead of time */
+struct stage_entry {
+	/* Index of the block on disk */
+	size_t block;
+	enum stage_state state;
+	/* Order of the request, the oldest ones are read and reclaimed first */
+	unsigned long seq;
+};
+
+/* Readahead thread and its staging area */
+struct readahead {
+	/* Thread start was attempted, on the first readahead request */
+	int started;
+	/* Thread was started */
+	int running;
+	/* Thread was asked to exit */
+	int stop;
+	pthread_t thread;
+	/* Protects the staging slots, which the thread shares with the cache */
+	pthread_mutex_t lock;
+	/* Signal new requests to the thread, and finished reads to the cache */
+	pthread_cond_t queued, loaded;
+	/* Staging slot descriptions and their data */
+	struct stage_entry entries[CACHE_READAHEAD_BLOCKS];
+	uint8_t *data;
+	unsigned long seq;
+};
+
+/* Cached block */
+struct cache_entry {
+	/* Index of the block on disk */
+	size_t block;
+	/* Block was modified since it was last written to disk */
+	int dirty;
+	/* Block is being read from disk, without the cache lock held */
+	int busy;
+	/* Neighbours in the LRU list */
+	int prev, next;
+};
+
+/* Block cache description */
+struct cache {
+	/* Virtual disk the blocks belong to */
+	struct disk *disk;
+	/* Protects the whole description, except the readahead state */
+	pthread_mutex_t lock;
+	/* Signals that a block finished loading */
+	pthread_cond_t loaded;
+	/* Maximum number of cached blocks */
+	size_t capacity;
+	/* Number of slots in use */
+	size_t used;
+	/* Slot descriptions and their data */
+	struct cache_entry *entries;
+	uint8_t *data;
+	/* Slot holding each block of the disk, or NO_SLOT */
+	int *slot_of;
+	size_t bcount;
+	/* Most and least recently used slots */
+	int head, tail;
+	struct cache_stats stats;
+	/* Blocks being read ahead, never present in the cache itself */
+	struct readahead ra;
+};
+
+static uint8_t *slot_data(struct cache *cache, int slot)
+{
+	return cache->data + (size_t)slot * BLOCK_SIZE;
+}
+
+static void lru_unlink(struct cache *cache, int slot)
+{
+	struct cache_entry *e = &cache->entries[slot];
+
+	if (e->prev != NO_SLOT)
+		cache->entries[e->prev].next = e->next;
+	else
+		cache->head = e->next;
+
+	if (e->next != NO_SLOT)
+		cache->entries[e->next].prev = e->prev;
+	else
+		cache->tail = e->prev;
+}
+
+static void lru_push_front(struct cache *cache, int slot)
+{
+	struct cache_entry *e = &cache->entries[slot];
+
+	e->prev = NO_SLOT;
+	e->next = cache->head;
+	if (cache->head != NO_SLOT)
+		cache->entries[cache->head].prev = slot;
+	cache->head = slot;
+	if (cache->tail == NO_SLOT)
+		cache->tail = slot;
+}
+
+static void lru_push_back(struct cache *cache, int slot)
+{
+	struct cache_entry *e = &cache->entries[slot];
+
+	e->prev = cache->tail;
+	e->next = NO_SLOT;
+	if (cache->tail != NO_SLOT)
+		cache->entries[cache->tail].next = slot;
+	cache->tail = slot;
+	if (cache->head == NO_SLOT)
+		cache->head = slot;
+}
+
+static void lru_touch(struct cache *cache, int slot)
+{
+	if (cache->head == slot)
+		return;
+	lru_unlink(cache, slot);
+	lru_push_front(cache, slot);
+}
+
+/*
+ * Write the dirty blocks of slots @slots back through the disk scheduler, which
+ * merges consecutive blocks into single transfers
+ */
+static int write_slots(struct cache *cache, const int *slots, size_t n)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		struct cache_entry *e = &cache->entries[slots[i]];
+
+		if (disk_queue_write(cache->disk, e->block,
+				     slot_data(cache, slots[i])) == -1)
+			ret = -1;
+	}
+
+	if (disk_queue_wait(cache->disk) == -1 || ret == -1)
+		return -1;
+
+	for (size_t i = 0; i < n; i++)
+		cache->entries[slots[i]].dirty = 0;
+	cache->stats.writebacks += n;
+
+	return 0;
+}
+
+/*
+ * Write dirty block @slot back before it gets evicted, along with the other
+ * dirty blocks of the least recently used half of the cache, which are next
+ * in line: a long write turns into a few large writes rather than one write
+ * per evicted block
+ */
+static int writeback(struct cache *cache, int slot)
+{
+	int slots[CACHE_FLUSH_RUN];
+	size_t n = 0, scan = cache->capacity / 2;
+
+	if (!cache->entries[slot].dirty)
+		return 0;
+
+	slots[n++] = slot;
+	for (int s = cache->tail; s != NO_SLOT && scan && n < CACHE_FLUSH_RUN;
+	     s = cache->entries[s].prev, scan--) {
+		if (s != slot && cache->entries[s].dirty)
+			slots[n++] = s;
+	}
+
+	return write_slots(cache, slots, n);
+}
+
+/*
+ * Find a slot that can hold another block: an unused one, or the least
+ * recently used one that is not being loaded
+ */
+static int victim(struct cache *cache)
+{
+	int slot;
+
+	if (cache->used < cache->capacity)
+		return cache->used;
+
+	for (slot = cache->tail; slot != NO_SLOT; slot = cache->entries[slot].prev) {
+		if (!cache->entries[slot].busy)
+			return slot;
+	}
+
+	return NO_SLOT;
+}
+
+/*
+ * Wait until @block is not being loaded and, if it is not cached, until a slot
+ * can be given to it. Return the slot of @block, or NO_SLOT if it is not cached.
+ */
+static int settle(struct cache *cache, size_t block)
+{
+	for (;;) {
+		int slot = cache->slot_of[block];
+
+		if (slot != NO_SLOT && !cache->entries[slot].busy)
+			return slot;
+		if (slot == NO_SLOT && victim(cache) != NO_SLOT)
+			return NO_SLOT;
+		pthread_cond_wait(&cache->loaded, &cache->lock);
+	}
+}
+
+/*
+ * Get a slot for @block, evicting the least recently used block if needed. A
+ * slot must be available (see settle()).
+ */
+static int get_slot(struct cache *cache, size_t block)
+{
+	int slot;
+
+	if (cache->used < cache->capacity) {
+		slot = cache->used++;
+	} else {
+		slot = victim(cache);
+		if (writeback(cache, slot) == -1)
+			return NO_SLOT;
+		lru_unlink(cache, slot);
+		if (cache->slot_of[cache->entries[slot].block] == slot)
+			cache->slot_of[cache->entries[slot].block] = NO_SLOT;
+	}
+
+	cache->entries[slot].block = block;
+	cache->entries[slot].dirty = 0;
+	cache->entries[slot].busy = 0;
+	cache->slot_of[block] = slot;
+	lru_push_front(cache, slot);
+
+	return slot;
+}
+
+static uint8_t *stage_data(struct cache *cache, int stage)
+{
+	return cache->ra.data + (size_t)stage * BLOCK_SIZE;
+}
+
+/* Find the staging slot holding @block, with the lock held */
+static int stage_find(struct cache *cache, size_t block)
+{
+	for (int i = 0; i < CACHE_READAHEAD_BLOCKS; i++) {
+		if (cache->ra.entries[i].state != STAGE_FREE &&
+		    cache->ra.entries[i].block == block)
+			return i;
+	}
+
+	return NO_STAGE;
+}
+
+/* Find the oldest staging slot in state @state, with the lock held */
+static int stage_oldest(struct cache *cache, enum stage_state state)
+{
+	int oldest = NO_STAGE;
+
+	for (int i = 0; i < CACHE_READAHEAD_BLOCKS; i++) {
+		if (cache->ra.entries[i].state == state &&
+		    (oldest == NO_STAGE ||
+		     cache->ra.entries[i].seq < cache->ra.entries[oldest].seq))
+			oldest = i;
+	}
+
+	return oldest;
+}
+
+/* Wait until @block is not being read, with the lock held */
+static int stage_settle(struct cache *cache, size_t block)
+{
+	int stage = stage_find(cache, block);
+
+	while (stage != NO_STAGE &&
+	       cache->ra.entries[stage].state == STAGE_LOADING) {
+		pthread_cond_wait(&cache->ra.loaded, &cache->ra.lock);
+		stage = stage_find(cache, block);
+	}
+
+	return stage;
+}
+
+/*
+ * Move @block from the staging area into @buf. Return 1 if it was staged,
+ * 0 if it has to be read from disk. Called without the cache lock held, once
+ * the readahead thread is running.
+ */
+static int stage_take(struct cache *cache, size_t block, void *buf)
+{
+	int stage, found = 0;
+
+	pthread_mutex_lock(&cache->ra.lock);
+
+	/* Rather than waiting behind other requests, read it right away */
+	stage = stage_find(cache, block);
+	if (stage != NO_STAGE && cache->ra.entries[stage].state == STAGE_QUEUED)
+		cache->ra.entries[stage].state = STAGE_FREE;
+
+	stage = stage_settle(cache, block);
+	if (stage != NO_STAGE) {
+		memcpy(buf, stage_data(cache, stage), BLOCK_SIZE);
+		cache->ra.entries[stage].state = STAGE_FREE;
+		found = 1;
+	}
+
+	pthread_mutex_unlock(&cache->ra.lock);
+
+	return found;
+}
+
+/*
+ * Forget the staged copy of @block, which is about to be modified. Lock order
+ * is the cache lock, then the readahead lock.
+ */
+static void stage_drop(struct cache *cache, size_t block)
+{
+	int stage;
+
+	if (!cache->ra.running)
+		return;
+
+	pthread_mutex_lock(&cache->ra.lock);
+	stage = stage_settle(cache, block);
+	if (stage != NO_STAGE)
+		cache->ra.entries[stage].state = STAGE_FREE;
+	pthread_mutex_unlock(&cache->ra.lock);
+}
+
+/*
+ * Read the requested blocks, oldest request first, along with the requests
+ * for the blocks that follow it on disk
+ */
+static void *readahead_thread(void *arg)
+{
+	struct cache *cache = arg;
+
+	pthread_mutex_lock(&cache->ra.lock);
+	while (!cache->ra.stop) {
+		struct iovec iov[READAHEAD_RUN];
+		int run[READAHEAD_RUN];
+		int n = 0, ret;
+		size_t block;
+
+		run[0] = stage_oldest(cache, STAGE_QUEUED);
+		if (run[0] == NO_STAGE) {
+			pthread_cond_wait(&cache->ra.queued, &cache->ra.lock);
+			continue;
+		}
+
+		block = cache->ra.entries[run[0]].block;
+		do {
+			cache->ra.entries[run[n]].state = STAGE_LOADING;
+			iov[n].iov_base = stage_data(cache, run[n]);
+			iov[n].iov_len = BLOCK_SIZE;
+			n++;
+		} while (n < READAHEAD_RUN &&
+			 (run[n] = stage_find(cache, block + n)) != NO_STAGE &&
+			 cache->ra.entries[run[n]].state == STAGE_QUEUED);
+
+		pthread_mutex_unlock(&cache->ra.lock);
+		ret = disk_readv(cache->disk, block, iov, n);
+		pthread_mutex_lock(&cache->ra.lock);
+
+		/* Blocks that cannot be read ahead are read on demand */
+		for (int i = 0; i < n; i++)
+			cache->ra.entries[run[i]].state = ret ? STAGE_FREE :
+							       STAGE_READY;
+		pthread_cond_broadcast(&cache->ra.loaded);
+	}
+	pthread_mutex_unlock(&cache->ra.lock);
+
+	return NULL;
+}
+
+/* Start the readahead thread, the cache works without it if it cannot */
+static void readahead_start(struct cache *cache)
+{
+	cache->ra.data = malloc(CACHE_READAHEAD_BLOCKS * BLOCK_SIZE);
+	if (!cache->ra.data)
+		return;
+
+	pthread_mutex_init(&cache->ra.lock, NULL);
+	pthread_cond_init(&cache->ra.queued, NULL);
+	pthread_cond_init(&cache->ra.loaded, NULL);
+
+	if (pthread_create(&cache->ra.thread, NULL, readahead_thread, cache)) {
+		pthread_mutex_destroy(&cache->ra.lock);
+		pthread_cond_destroy(&cache->ra.queued);
+		pthread_cond_destroy(&cache->ra.loaded);
+		free(cache->ra.data);
+		cache->ra.data = NULL;
+		return;
+	}
+
+	cache->ra.running = 1;
+}
+
+static void readahead_stop(struct cache *cache)
+{
+	if (!cache->ra.running)
+		return;
+
+	pthread_mutex_lock(&cache->ra.lock);
+	cache->ra.stop = 1;
+	pthread_cond_signal(&cache->ra.queued);
+	pthread_mutex_unlock(&cache->ra.lock);
+	pthread_join(cache->ra.thread, NULL);
+
+	pthread_mutex_destroy(&cache->ra.lock);
+	pthread_cond_destroy(&cache->ra.queued);
+	pthread_cond_destroy(&cache->ra.loaded);
+	free(cache->ra.data);
+	cache->ra.running = 0;
+}
+
+struct cache *cache_create(struct disk *disk, size_t nblocks)
+{
+	struct cache *cache;
+	int count;
+
+	if ((count = disk_count(disk)) == -1)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		cache_error("cannot allocate cache");
+		return NULL;
+	}
+
+	cache->disk = disk;
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->loaded, NULL);
+	cache->capacity = nblocks;
+	cache->bcount = count;
+	cache->head = cache->tail = NO_SLOT;
+
+	if (nblocks) {
+		cache->entries = calloc(nblocks, sizeof(struct cache_entry));
+		cache->data = malloc(nblocks * BLOCK_SIZE);
+		cache->slot_of = malloc(cache->bcount * sizeof(int));
+		if (!cache->entries || !cache->data || !cache->slot_of) {
+			free(cache->entries);
+			free(cache->data);
+			free(cache->slot_of);
+			pthread_mutex_destroy(&cache->lock);
+			pthread_cond_destroy(&cache->loaded);
+			free(cache);
+			cache_error("cannot allocate %zu blocks", nblocks);
+			return NULL;
+		}
+		for (size_t i = 0; i < cache->bcount; i++)
+			cache->slot_of[i] = NO_SLOT;
+	}
+
+	return cache;
+}
+
+int cache_destroy(struct cache *cache)
+{
+	int ret;
+
+	if (!cache) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	readahead_stop(cache);
+	ret = cache_flush(cache);
+
+	free(cache->entries);
+	free(cache->data);
+	free(cache->slot_of);
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->loaded);
+	free(cache);
+
+	return ret;
+}
+
+int cache_read(struct cache *cache, size_t block, void *buf)
+{
+	int slot, staged, readahead, ret;
+
+	if (!cache) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!cache->capacity) {
+		pthread_mutex_lock(&cache->lock);
+		cache->stats.misses++;
+		pthread_mutex_unlock(&cache->lock);
+		return disk_read(cache->disk, block, buf);
+	}
+
+	if (block >= cache->bcount) {
+		cache_error("block index out of bounds (%zu/%zu)",
+			    block, cache->bcount);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	slot = settle(cache, block);
+	if (slot != NO_SLOT) {
+		cache->stats.hits++;
+		lru_touch(cache, slot);
+		memcpy(buf, slot_data(cache, slot), BLOCK_SIZE);
+		pthread_mutex_unlock(&cache->lock);
+		return 0;
+	}
+
+	if ((slot = get_slot(cache, block)) == NO_SLOT) {
+		pthread_mutex_unlock(&cache->lock);
+		return -1;
+	}
+
+	/* Load the block without the lock, the rest of the cache stays usable */
+	cache->entries[slot].busy = 1;
+	readahead = cache->ra.running;
+	pthread_mutex_unlock(&cache->lock);
+
+	staged = readahead && stage_take(cache, block, slot_data(cache, slot));
+	ret = staged ? 0 : disk_read(cache->disk, block, slot_data(cache, slot));
+
+	pthread_mutex_lock(&cache->lock);
+	cache->entries[slot].busy = 0;
+	pthread_cond_broadcast(&cache->loaded);
+
+	if (staged)
+		cache->stats.readahead++;
+	else
+		cache->stats.misses++;
+
+	if (ret == -1) {
+		/* Give the slot back as the next one to be evicted */
+		cache->slot_of[block] = NO_SLOT;
+		lru_unlink(cache, slot);
+		lru_push_back(cache, slot);
+	} else {
+		memcpy(buf, slot_data(cache, slot), BLOCK_SIZE);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+int cache_write(struct cache *cache, size_t block, const void *buf)
+{
+	int slot;
+
+	if (!cache) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!cache->capacity)
+		return disk_write(cache->disk, block, buf);
+
+	if (block >= cache->bcount) {
+		cache_error("block index out of bounds (%zu/%zu)",
+			    block, cache->bcount);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	slot = settle(cache, block);
+	if (slot != NO_SLOT) {
+		cache->stats.hits++;
+		lru_touch(cache, slot);
+	} else {
+		/* The whole block gets overwritten, no need to read it first */
+		cache->stats.misses++;
+		if ((slot = get_slot(cache, block)) == NO_SLOT) {
+			pthread_mutex_unlock(&cache->lock);
+			return -1;
+		}
+		stage_drop(cache, block);
+	}
+
+	memcpy(slot_data(cache, slot), buf, BLOCK_SIZE);
+	cache->entries[slot].dirty = 1;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+int cache_prefetch(struct cache *cache, const size_t *blocks, size_t count)
+{
+	int slots[BLOCK_QUEUE_DEPTH];
+	int n = 0, ret = 0;
+
+	if (!cache) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* Keep the prefetched blocks from evicting each other */
+	if (count > cache->capacity / 2)
+		count = cache->capacity / 2;
+	if (count > BLOCK_QUEUE_DEPTH)
+		count = BLOCK_QUEUE_DEPTH;
+
+	for (size_t i = 0; i < count; i++) {
+		int slot;
+
+		if (blocks[i] >= cache->bcount ||
+		    cache->slot_of[blocks[i]] != NO_SLOT)
+			continue;
+
+		/* Already read ahead, cache_read() picks it up */
+		if (cache->ra.running) {
+			pthread_mutex_lock(&cache->ra.lock);
+			slot = stage_find(cache, blocks[i]);
+			pthread_mutex_unlock(&cache->ra.lock);
+			if (slot != NO_STAGE)
+				continue;
+		}
+
+		/* Only a hint, do not wait for blocks being loaded */
+		if (victim(cache) == NO_SLOT)
+			break;
+
+		cache->stats.misses++;
+		if ((slot = get_slot(cache, blocks[i])) == NO_SLOT) {
+			ret = -1;
+			break;
+		}
+
+		slots[n++] = slot;
+		if (disk_queue_read(cache->disk, blocks[i],
+				    slot_data(cache, slot)) == -1) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if (disk_queue_wait(cache->disk) == -1)
+		ret = -1;
+
+	/* Do not keep blocks that may not have been read */
+	if (ret == -1) {
+		for (int i = 0; i < n; i++) {
+			cache->slot_of[cache->entries[slots[i]].block] = NO_SLOT;
+			lru_unlink(cache, slots[i]);
+			lru_push_back(cache, slots[i]);
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+int cache_readahead(struct cache *cache, const size_t *blocks, size_t count)
+{
+	int requested = 0;
+
+	if (!cache) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!cache->capacity)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* Caches that are never read sequentially do without the thread */
+	if (!cache->ra.started) {
+		cache->ra.started = 1;
+		readahead_start(cache);
+	}
+	if (!cache->ra.running) {
+		pthread_mutex_unlock(&cache->lock);
+		return 0;
+	}
+
+	pthread_mutex_lock(&cache->ra.lock);
+	for (size_t i = 0; i < count; i++) {
+		int stage;
+
+		if (blocks[i] >= cache->bcount ||
+		    cache->slot_of[blocks[i]] != NO_SLOT ||
+		    stage_find(cache, blocks[i]) != NO_STAGE)
+			continue;
+
+		/* Reclaim the oldest staged block if the staging area is full */
+		stage = stage_oldest(cache, STAGE_FREE);
+		if (stage == NO_STAGE)
+			stage = stage_oldest(cache, STAGE_READY);
+		if (stage == NO_STAGE)
+			stage = stage_oldest(cache, STAGE_QUEUED);
+		if (stage == NO_STAGE)
+			break;
+
+		cache->ra.entries[stage].block = blocks[i];
+		cache->ra.entries[stage].state = STAGE_QUEUED;
+		cache->ra.entries[stage].seq = ++cache->ra.seq;
+		requested = 1;
+	}
+	if (requested)
+		pthread_cond_signal(&cache->ra.queued);
+	pthread_mutex_unlock(&cache->ra.lock);
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+int cache_flush(struct cache *cache)
+{
+	int ret = 0;
+
+	if (!cache) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (!cache->capacity)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* The disk scheduler sorts the blocks and merges the consecutive ones */
+	for (size_t slot = 0; slot < cache->used; slot++) {
+		if (cache->entries[slot].dirty &&
+		    disk_queue_write(cache->disk, cache->entries[slot].block,
+				     slot_data(cache, slot)) == -1)
+			ret = -1;
+	}
+
+	if (disk_queue_wait(cache->disk) == -1 || ret == -1) {
+		pthread_mutex_unlock(&cache->lock);
+		return -1;
+	}
+
+	for (size_t slot = 0; slot < cache->used; slot++) {
+		if (cache->entries[slot].dirty) {
+			cache->entries[slot].dirty = 0;
+			cache->stats.writebacks++;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+int cache_get_stats(struct cache *cache, struct cache_stats *stats)
+{
+	if (!cache) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "disk.h"
+
+/** Number of blocks held by the block cache unless configured otherwise */
+#define CACHE_DEFAULT_BLOCKS 64
+
+/** Number of blocks the readahead staging area can hold */
+#define CACHE_READAHEAD_BLOCKS 32
+
+/* Block cache counters */
+struct cache_stats {
+	/* Lookups served from the cache */
+	size_t hits;
+	/* Lookups that had to go to the disk */
+	size_t misses;
+	/* Dirty blocks written back to the disk */
+	size_t writebacks;
+	/* Lookups served from blocks read ahead */
+	size_t readahead;
+};
+
+/* Block cache of a virtual disk instance */
+struct cache;
+
+/**
+ * cache_create - Set up a block cache
+ * @disk: Virtual disk instance
+ * @nblocks: Maximum number of blocks the cache can hold
+ *
+ * Set up a write-back block cache of @nblocks blocks over virtual disk @disk.
+ * Once evicted, the least recently used block is written back to the disk if
+ * it is dirty, along with the other dirty blocks of the least recently used
+ * half of the cache. If @nblocks is 0, cache_read() and cache_write() go
+ * straight to disk_read() and disk_write().
+ *
+ * Return: NULL if @disk is NULL or if memory cannot be allocated. Otherwise,
+ * return the cache.
+ */
+struct cache *cache_create(struct disk *disk, size_t nblocks);
+
+/**
+ * cache_destroy - Tear down a block cache
+ * @cache: Block cache, released on return
+ *
+ * Write all the dirty blocks back to the disk and release the cache.
+ *
+ * Return: -1 if @cache is NULL or if a dirty block cannot be written back. 0
+ * otherwise.
+ */
+int cache_destroy(struct cache *cache);
+
+/**
+ * cache_read - Read a block through the cache
+ * @cache: Block cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Read the content of block @block (%BLOCK_SIZE bytes) into buffer @buf, from
+ * the cache if the block is present, from the readahead staging area if it was
+ * read ahead (waiting for the read to finish if needed), from the disk
+ * otherwise.
+ *
+ * Return: -1 if @cache is NULL or if the block cannot be read. 0 otherwise.
+ */
+int cache_read(struct cache *cache, size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @cache: Block cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Copy buffer @buf (%BLOCK_SIZE bytes) into the cached copy of block @block
+ * and mark it dirty. The block only reaches the disk when it gets evicted, or
+ * on cache_flush() or cache_destroy().
+ *
+ * Return: -1 if @cache is NULL or if a block cannot be evicted. 0 otherwise.
+ */
+int cache_write(struct cache *cache, size_t block, const void *buf);
+
+/**
+ * cache_prefetch - Bring blocks into the cache
+ * @cache: Block cache
+ * @blocks: Indexes of the blocks to read
+ * @count: Number of blocks in @blocks
+ *
+ * Read the blocks of @blocks that are not cached yet with a single batch of
+ * queued requests, so that the following cache_read() calls find them in the
+ * cache. At most half of the cache is used for prefetched blocks.
+ *
+ * Return: -1 if @cache is NULL or if a block cannot be read. 0 otherwise.
+ */
+int cache_prefetch(struct cache *cache, const size_t *blocks, size_t count);
+
+/**
+ * cache_readahead - Read blocks ahead of time in the background
+ * @cache: Block cache
+ * @blocks: Indexes of the blocks to read
+ * @count: Number of blocks in @blocks
+ *
+ * Hand the blocks of @blocks that are not cached yet to the readahead thread of
+ * @cache, started by the first call, and return without waiting. The thread reads them, consecutive blocks
+ * together, into a staging area of %CACHE_READAHEAD_BLOCKS blocks that
+ * cache_read() looks into before going to the disk. When the staging area is
+ * full, the oldest blocks read ahead and not used yet are dropped. This is a
+ * no-op if the cache was set up with 0 blocks.
+ *
+ * Return: -1 if @cache is NULL. 0 otherwise.
+ */
+int cache_readahead(struct cache *cache, const size_t *blocks, size_t count);
+
+/**
+ * cache_flush - Write dirty blocks back to disk
+ * @cache: Block cache
+ *
+ * Write every dirty block back to the disk through the disk scheduler, which
+ * performs the writes in increasing block order and merges consecutive blocks.
+ * Blocks stay cached and become clean.
+ *
+ * Return: -1 if @cache is NULL or if a block cannot be written. 0 otherwise.
+ */
+int cache_flush(struct cache *cache);
+
+/**
+ * cache_get_stats - Get the cache counters
+ * @cache: Block cache
+ * @stats: Structure to be filled with the counters
+ *
+ * Return: -1 if @cache is NULL. 0 otherwise.
+ */
+int cache_get_stats(struct cache *cache, struct cache_stats *stats);
+
+#endif /* _CACHE_H */
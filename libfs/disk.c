@@ -1,17 +1,82 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "uring.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Maximum number of buffers per vectored system call */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Maximum number of requests the scheduler collects before dispatching them */
+#define SCHED_DEPTH 256
+
+/* Maximum number of blocks merged into a single transfer */
+#define SCHED_MERGE_MAX 64
+
+/* Request collected by the scheduler */
+struct block_request {
+	/* Write request if non-zero, read request otherwise */
+	int write_op;
+	/* Index of the block */
+	size_t block;
+	/* Data buffer */
+	void *buf;
+	/* Error flag of the thread that queued the request, see queue() */
+	int *error;
+};
+
+/* Transfer of consecutive blocks submitted to io_uring */
+struct block_transfer {
+	/* Write transfer if non-zero, read transfer otherwise */
+	int write_op;
+	/* Index of the first block */
+	size_t block;
+	/* One buffer per block, read by the kernel until completion */
+	struct iovec iov[SCHED_MERGE_MAX];
+	int iovcnt;
+	/* Error flag of the request behind each block */
+	int *errors[SCHED_MERGE_MAX];
+};
+
+/* Records buffered in each of the two buffers of a trace */
+#define TRACE_BUF 1024
+
+/*
+ * Block request trace being recorded, see disk_trace_start(). Requests are
+ * recorded in one buffer while the other one is written to the file
+ */
+struct disk_trace {
+	/* Trace file */
+	int fd;
+	/* Time the trace started at, in nanoseconds */
+	uint64_t start;
+	/* Records not written to the file yet, in bufs[cur] */
+	struct block_trace_record bufs[2][TRACE_BUF];
+	int cur;
+	size_t count;
+	/* Whether the other buffer is being written, without the trace lock */
+	int writing;
+	/* Requests waiting for both buffers to be written */
+	int waiters;
+	/* Whether writing to the file failed */
+	int error;
+};
 
 /* Disk instance description */
 struct disk {
@@ -19,126 +84,953 @@ struct disk {
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Backend serving the block requests */
+	enum block_backend backend;
+	/* Mapping of the whole image (BLOCK_BACKEND_MMAP only) */
+	uint8_t *map;
+	/* Requests queued but not dispatched yet */
+	struct block_request pending[SCHED_DEPTH];
+	int npending;
+	/* Time the oldest pending request was queued at, in microseconds */
+	uint64_t oldest;
+	/* Longest time a request stays pending, in microseconds */
+	unsigned int deadline;
+	/* Asynchronous transfers (BLOCK_BACKEND_URING only) */
+	struct uring ring;
+	struct block_transfer xfers[BLOCK_QUEUE_DEPTH];
+	/* Transfer slots that are not in flight */
+	int free_xfers[BLOCK_QUEUE_DEPTH];
+	int nfree;
+	/* Protects the request queue, other requests need no locking */
+	pthread_mutex_t queue_lock;
+	/*
+	 * Trace being recorded, NULL if none. Only set and cleared with
+	 * trace_lock held, which also protects the trace itself
+	 */
+	struct disk_trace *trace;
+	pthread_mutex_t trace_lock;
+	/* Signaled when a trace buffer was written */
+	pthread_cond_t trace_cond;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Blocks requested by the calling thread, see disk_thread_io() */
+static __thread size_t thread_reads, thread_writes;
 
-int block_disk_open(const char *diskname)
+/*
+ * A request queued by the calling thread failed since its last
+ * disk_queue_wait(). Set by whichever thread performs the request, with the
+ * queue lock held
+ */
+static __thread int thread_queue_error;
+
+/* Tag recorded with the requests of the calling thread, see disk_thread_tag() */
+static __thread int thread_tag;
+
+/* Disk opened with block_disk_open(), which the block_*() functions use */
+static struct disk *block_disk;
+
+struct disk *disk_open(const char *diskname, enum block_backend backend)
 {
+	struct disk *disk;
 	int fd;
 	struct stat st;
+	void *map = NULL;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
-		return -1;
-	}
-
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+		return NULL;
 	}
 
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return NULL;
+	}
+
+	disk = calloc(1, sizeof(*disk));
+	if (!disk) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
+
+	if (backend == BLOCK_BACKEND_MMAP) {
+		if (st.st_size == 0) {
+			block_error("cannot map an empty disk");
+			goto err;
+		}
+
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			goto err;
+		}
+	} else if (backend == BLOCK_BACKEND_URING) {
+		/* Fall back to plain system calls if io_uring is unavailable */
+		if (uring_setup(&disk->ring, BLOCK_QUEUE_DEPTH))
+			backend = BLOCK_BACKEND_FILE;
+		for (int i = 0; i < BLOCK_QUEUE_DEPTH; i++)
+			disk->free_xfers[i] = i;
+		disk->nfree = BLOCK_QUEUE_DEPTH;
+	} else if (backend != BLOCK_BACKEND_FILE) {
+		block_error("invalid backend '%d'", backend);
+		goto err;
+	}
+
+	disk->fd = fd;
+	disk->bcount = st.st_size / BLOCK_SIZE;
+	disk->backend = backend;
+	disk->map = map;
+	disk->deadline = BLOCK_SCHED_DEADLINE;
+	pthread_mutex_init(&disk->queue_lock, NULL);
+	pthread_mutex_init(&disk->trace_lock, NULL);
+	pthread_cond_init(&disk->trace_cond, NULL);
+
+	return disk;
+
+err:
+	free(disk);
+	close(fd);
+	return NULL;
+}
+
+int disk_close(struct disk *disk)
+{
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	/* Requests still queued are performed before closing */
+	disk_queue_wait(disk);
+	disk_trace_stop(disk);
+
+	if (disk->map)
+		munmap(disk->map, disk->bcount * BLOCK_SIZE);
+
+	if (disk->backend == BLOCK_BACKEND_URING)
+		uring_teardown(&disk->ring);
+
+	close(disk->fd);
+	pthread_mutex_destroy(&disk->queue_lock);
+	pthread_mutex_destroy(&disk->trace_lock);
+	pthread_cond_destroy(&disk->trace_cond);
+	free(disk);
 
 	return 0;
 }
 
-int block_disk_close(void)
+int disk_sync(struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	/*
+	 * Blocks written with system calls are in the image file, but may only
+	 * be in the page cache: have them written to the device before
+	 * returning, the journal relies on it to order its writes
+	 */
+	if (!disk->map) {
+		if (fdatasync(disk->fd)) {
+			perror("fdatasync");
+			return -1;
+		}
+		return 0;
+	}
 
-	disk.fd = INVALID_FD;
+	if (msync(disk->map, disk->bcount * BLOCK_SIZE, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
 
 	return 0;
 }
 
-int block_disk_count(void)
+int disk_count(struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return disk->bcount;
 }
 
-int block_write(size_t block, const void *buf)
+/*
+ * Transfer the buffers described by @iov at offset @off of the disk image,
+ * resuming after short transfers and interrupted system calls. @iov is
+ * consumed along the way.
+ */
+static int transfer(struct disk *disk, int write_op, struct iovec *iov,
+		    int iovcnt, off_t off)
+{
+	if (disk->map) {
+		for (int i = 0; i < iovcnt; off += iov[i++].iov_len) {
+			if (write_op)
+				memcpy(disk->map + off, iov[i].iov_base,
+				       iov[i].iov_len);
+			else
+				memcpy(iov[i].iov_base, disk->map + off,
+				       iov[i].iov_len);
+		}
+		return 0;
+	}
+
+	while (iovcnt > 0) {
+		ssize_t n;
+		int cnt = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+
+		if (cnt == 1 && write_op)
+			n = pwrite(disk->fd, iov->iov_base, iov->iov_len, off);
+		else if (cnt == 1)
+			n = pread(disk->fd, iov->iov_base, iov->iov_len, off);
+		else if (write_op)
+			n = pwritev(disk->fd, iov, cnt, off);
+		else
+			n = preadv(disk->fd, iov, cnt, off);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(write_op ? "write" : "read");
+			return -1;
+		}
+
+		if (n == 0) {
+			block_error("unexpected end of disk image");
+			return -1;
+		}
+
+		off += n;
+
+		/* Skip what was transferred */
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static uint64_t now_ns(void)
 {
-	if (disk.fd == INVALID_FD) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Write the @count records of @buf to the file of @trace */
+static int trace_write(struct disk_trace *trace,
+		       const struct block_trace_record *buf, size_t count)
+{
+	const char *p = (const char *)buf;
+	size_t len = count * sizeof(*buf);
+
+	while (len) {
+		ssize_t n = write(trace->fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("write");
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Write full buffer @buf of @trace to its file, without the trace lock so that
+ * requests keep being recorded in the other buffer, then the buffers that
+ * filled up in the meantime
+ */
+static void trace_drain(struct disk *disk, struct disk_trace *trace,
+			const struct block_trace_record *buf)
+{
+	for (;;) {
+		int ret = trace_write(trace, buf, TRACE_BUF);
+
+		pthread_mutex_lock(&disk->trace_lock);
+		if (ret)
+			trace->error = 1;
+		pthread_cond_broadcast(&disk->trace_cond);
+		if (trace->count < TRACE_BUF) {
+			trace->writing = 0;
+			pthread_mutex_unlock(&disk->trace_lock);
+			return;
+		}
+		buf = trace->bufs[trace->cur];
+		trace->cur ^= 1;
+		trace->count = 0;
+		pthread_mutex_unlock(&disk->trace_lock);
+	}
+}
+
+/*
+ * Count the @nblocks blocks from block @block requested by the calling thread,
+ * and record the request if @disk is being traced
+ */
+static void account(struct disk *disk, int write_op, size_t block,
+		    size_t nblocks)
+{
+	struct disk_trace *trace;
+	struct block_trace_record *rec, *full;
+
+	if (write_op)
+		thread_writes += nblocks;
+	else
+		thread_reads += nblocks;
+
+	/*
+	 * Unlocked check to keep untraced requests cheap, the trace is only
+	 * used once loaded again under the lock: it can stop in the meantime
+	 */
+	if (!__atomic_load_n(&disk->trace, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&disk->trace_lock);
+	trace = disk->trace;
+
+	/* Both buffers are full: wait for the file to catch up */
+	while (trace && trace->count == TRACE_BUF) {
+		trace->waiters++;
+		pthread_cond_wait(&disk->trace_cond, &disk->trace_lock);
+		trace->waiters--;
+		if (disk->trace != trace) {
+			/* Stopped in the meantime, let disk_trace_stop() free it */
+			pthread_cond_broadcast(&disk->trace_cond);
+			trace = NULL;
+		}
+	}
+	if (!trace) {
+		pthread_mutex_unlock(&disk->trace_lock);
+		return;
+	}
+
+	rec = &trace->bufs[trace->cur][trace->count++];
+	rec->time = now_ns() - trace->start;
+	rec->block = block;
+	rec->count = nblocks;
+	rec->op = write_op ? BLOCK_TRACE_WRITE : BLOCK_TRACE_READ;
+	rec->tag = thread_tag;
+
+	/* The first request to fill a buffer writes it, unless the other one is still being written */
+	full = NULL;
+	if (trace->count == TRACE_BUF && !trace->writing) {
+		full = trace->bufs[trace->cur];
+		trace->cur ^= 1;
+		trace->count = 0;
+		trace->writing = 1;
+	}
+	pthread_mutex_unlock(&disk->trace_lock);
+
+	if (full)
+		trace_drain(disk, trace, full);
+}
+
+/* Check that @len bytes starting at block @block lie within the disk */
+static int check_range(struct disk *disk, size_t block, size_t len)
+{
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (len % BLOCK_SIZE != 0) {
+		block_error("length '%zu' is not multiple of '%d'",
+			    len, BLOCK_SIZE);
+		return -1;
+	}
+
+	if (block >= disk->bcount || len / BLOCK_SIZE > disk->bcount - block) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, disk->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return 0;
+}
+
+/* Transfer a vector of buffers at block @block */
+static int transferv(struct disk *disk, int write_op, size_t block,
+		     const struct iovec *iov, int iovcnt)
+{
+	struct iovec *copy;
+	size_t len = 0;
+	int ret;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (check_range(disk, block, len))
+		return -1;
+	account(disk, write_op, block, len / BLOCK_SIZE);
+
+	/* transfer() consumes the vector, work on a copy of it */
+	copy = malloc(iovcnt * sizeof(*copy));
+	if (!copy) {
+		perror("malloc");
 		return -1;
 	}
+	memcpy(copy, iov, iovcnt * sizeof(*copy));
+
+	ret = transfer(disk, write_op, copy, iovcnt, (off_t)block * BLOCK_SIZE);
+
+	free(copy);
+
+	return ret;
+}
+
+int disk_write(struct disk *disk, size_t block, const void *buf)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = BLOCK_SIZE };
+
+	if (check_range(disk, block, BLOCK_SIZE))
+		return -1;
+	account(disk, 1, block, 1);
 
 	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	return transfer(disk, 1, &iov, 1, (off_t)block * BLOCK_SIZE);
+}
+
+int disk_read(struct disk *disk, size_t block, void *buf)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = BLOCK_SIZE };
+
+	if (check_range(disk, block, BLOCK_SIZE))
 		return -1;
+	account(disk, 0, block, 1);
+
+	/* Perform the actual read from the disk image */
+	return transfer(disk, 0, &iov, 1, (off_t)block * BLOCK_SIZE);
+}
+
+int disk_writev(struct disk *disk, size_t block, const struct iovec *iov,
+		int iovcnt)
+{
+	return transferv(disk, 1, block, iov, iovcnt);
+}
+
+int disk_readv(struct disk *disk, size_t block, const struct iovec *iov,
+	       int iovcnt)
+{
+	return transferv(disk, 0, block, iov, iovcnt);
+}
+
+/* Report the failure of the @n requests whose error flags are @errors */
+static void fail(int **errors, int n)
+{
+	for (int i = 0; i < n; i++)
+		*errors[i] = 1;
+}
+
+/* Report the failure of the transfers in flight, which will not complete */
+static void fail_inflight(struct disk *disk)
+{
+	int busy[BLOCK_QUEUE_DEPTH];
+
+	for (int tag = 0; tag < BLOCK_QUEUE_DEPTH; tag++)
+		busy[tag] = 1;
+	for (int i = 0; i < disk->nfree; i++)
+		busy[disk->free_xfers[i]] = 0;
+
+	for (int tag = 0; tag < BLOCK_QUEUE_DEPTH; tag++) {
+		if (busy[tag])
+			fail(disk->xfers[tag].errors, disk->xfers[tag].iovcnt);
+	}
+}
+
+/* Account for the completion of transfer @tag */
+static void complete(struct disk *disk, uint64_t tag, int res)
+{
+	struct block_transfer *xfer = &disk->xfers[tag];
+	struct iovec *iov = xfer->iov;
+	int iovcnt = xfer->iovcnt;
+
+	if (res < 0) {
+		errno = -res;
+		perror(xfer->write_op ? "write" : "read");
+		fail(xfer->errors, xfer->iovcnt);
+	} else if (res < iovcnt * BLOCK_SIZE) {
+		/* Finish short transfers synchronously */
+		off_t off = (off_t)xfer->block * BLOCK_SIZE + res;
+
+		while (res >= BLOCK_SIZE) {
+			res -= BLOCK_SIZE;
+			iov++;
+			iovcnt--;
+		}
+		iov->iov_base = (char *)iov->iov_base + res;
+		iov->iov_len -= res;
+
+		if (transfer(disk, xfer->write_op, iov, iovcnt, off))
+			fail(xfer->errors, xfer->iovcnt);
 	}
 
+	disk->free_xfers[disk->nfree++] = tag;
+}
+
+/* Submit the queued transfers and wait for at least @wait_nr completions */
+static int drain(struct disk *disk, unsigned wait_nr)
+{
+	uint64_t tag;
+	int res, ret, reaped;
+
+	for (;;) {
+		ret = uring_submit(&disk->ring, wait_nr);
+		if (ret == -1)
+			return -1;
+
+		reaped = 0;
+		while (uring_reap(&disk->ring, &tag, &res)) {
+			complete(disk, tag, res);
+			reaped++;
+		}
+		if (!ret)
+			return 0;
+
+		/* The kernel is busy: retry once completions made room, if any */
+		if (!reaped)
+			return -1;
+	}
+}
+
+/* Start transferring @iovcnt consecutive blocks from block @block */
+static void submit(struct disk *disk, int write_op, size_t block,
+		   struct iovec *iov, int **errors, int iovcnt)
+{
+	struct block_transfer *xfer;
+	int tag;
+
+	if (disk->backend == BLOCK_BACKEND_URING) {
+		/* All the transfer slots are in flight, make room */
+		while (!disk->nfree) {
+			if (drain(disk, 1)) {
+				fail_inflight(disk);
+				fail(errors, iovcnt);
+				return;
+			}
+		}
+
+		tag = disk->free_xfers[--disk->nfree];
+		xfer = &disk->xfers[tag];
+		xfer->write_op = write_op;
+		xfer->block = block;
+		memcpy(xfer->iov, iov, iovcnt * sizeof(*iov));
+		memcpy(xfer->errors, errors, iovcnt * sizeof(*errors));
+		xfer->iovcnt = iovcnt;
+
+		if (!uring_queue(&disk->ring, write_op, disk->fd, xfer->iov,
+				 iovcnt, (off_t)block * BLOCK_SIZE, tag))
+			return;
+
+		/* Submission queue full, perform the transfer right away */
+		disk->free_xfers[disk->nfree++] = tag;
+	}
+
+	if (transfer(disk, write_op, iov, iovcnt, (off_t)block * BLOCK_SIZE))
+		fail(errors, iovcnt);
+}
+
+static int request_cmp(const void *a, const void *b)
+{
+	const struct block_request *ra = a, *rb = b;
+
+	return (ra->block > rb->block) - (ra->block < rb->block);
+}
+
+/*
+ * Dispatch the pending requests in block order, merging each run of requests
+ * for consecutive blocks in the same direction into a single transfer
+ */
+static void dispatch(struct disk *disk)
+{
+	struct iovec iov[SCHED_MERGE_MAX];
+	int *errors[SCHED_MERGE_MAX];
+	int i = 0;
+
+	qsort(disk->pending, disk->npending, sizeof(*disk->pending),
+	      request_cmp);
+
+	while (i < disk->npending) {
+		struct block_request *first = &disk->pending[i];
+		int n = 0;
+
+		while (i + n < disk->npending && n < SCHED_MERGE_MAX) {
+			struct block_request *req = &disk->pending[i + n];
+
+			if (req->write_op != first->write_op ||
+			    req->block != first->block + n)
+				break;
+			iov[n].iov_base = req->buf;
+			iov[n].iov_len = BLOCK_SIZE;
+			errors[n] = req->error;
+			n++;
+		}
+
+		submit(disk, first->write_op, first->block, iov, errors, n);
+		i += n;
+	}
+
+	disk->npending = 0;
+
+	/* Hand the transfers to the kernel without waiting for them */
+	if (disk->backend == BLOCK_BACKEND_URING && drain(disk, 0))
+		fail_inflight(disk);
+}
+
+/* Dispatch the pending requests and wait until all the transfers complete */
+static void settle(struct disk *disk)
+{
+	dispatch(disk);
+
+	if (disk->backend != BLOCK_BACKEND_URING)
+		return;
+
+	while (disk->nfree < BLOCK_QUEUE_DEPTH) {
+		if (drain(disk, 1)) {
+			fail_inflight(disk);
+			break;
+		}
+	}
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int queue(struct disk *disk, int write_op, size_t block, void *buf)
+{
+	struct block_request *req;
+
+	if (check_range(disk, block, BLOCK_SIZE))
+		return -1;
+	account(disk, write_op, block, 1);
+
+	pthread_mutex_lock(&disk->queue_lock);
+
+	/* Mapped disks perform the request right away, nothing to merge */
+	if (disk->map) {
+		struct iovec iov = { .iov_base = buf, .iov_len = BLOCK_SIZE };
+
+		if (transfer(disk, write_op, &iov, 1, (off_t)block * BLOCK_SIZE))
+			thread_queue_error = 1;
+		pthread_mutex_unlock(&disk->queue_lock);
+		return 0;
+	}
+
+	/* Requests involving a write to the same block are kept in order */
+	for (int i = 0; i < disk->npending; i++) {
+		if (disk->pending[i].block == block &&
+		    (write_op || disk->pending[i].write_op)) {
+			settle(disk);
+			break;
+		}
+	}
+
+	if (!disk->npending)
+		disk->oldest = now_us();
+
+	req = &disk->pending[disk->npending++];
+	req->write_op = write_op;
+	req->block = block;
+	req->buf = buf;
+	req->error = &thread_queue_error;
+
+	if (disk->npending == SCHED_DEPTH ||
+	    now_us() - disk->oldest >= disk->deadline)
+		dispatch(disk);
+
+	pthread_mutex_unlock(&disk->queue_lock);
+
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+int disk_queue_write(struct disk *disk, size_t block, const void *buf)
+{
+	return queue(disk, 1, block, (void *)buf);
+}
+
+int disk_queue_read(struct disk *disk, size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	return queue(disk, 0, block, buf);
+}
+
+int disk_queue_wait(struct disk *disk)
+{
+	int error;
+
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	pthread_mutex_lock(&disk->queue_lock);
+
+	settle(disk);
+
+	/* Other threads may perform our requests, but only we reset our flag */
+	error = thread_queue_error;
+	thread_queue_error = 0;
+
+	pthread_mutex_unlock(&disk->queue_lock);
+
+	return error ? -1 : 0;
+}
+
+int disk_sched_config(struct disk *disk, unsigned int deadline_us)
+{
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	pthread_mutex_lock(&disk->queue_lock);
+	disk->deadline = deadline_us;
+	pthread_mutex_unlock(&disk->queue_lock);
+
+	return 0;
+}
+
+void disk_thread_io(size_t *reads, size_t *writes)
+{
+	*reads = thread_reads;
+	*writes = thread_writes;
+}
+
+void disk_thread_tag(int tag)
+{
+	thread_tag = tag;
+}
+
+int disk_trace_start(struct disk *disk, const char *filename)
+{
+	struct block_trace_header header = {
+		.magic = BLOCK_TRACE_MAGIC,
+		.record_size = sizeof(struct block_trace_record),
+	};
+	struct disk_trace *trace;
+
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	/* Checked again when the trace is installed, but before truncating any file */
+	pthread_mutex_lock(&disk->trace_lock);
+	trace = disk->trace;
+	pthread_mutex_unlock(&disk->trace_lock);
+	if (trace) {
+		block_error("disk already traced");
+		return -1;
+	}
+
+	trace = malloc(sizeof(*trace));
+	if (!trace) {
+		perror("malloc");
+		return -1;
+	}
+
+	trace->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace->fd < 0) {
+		perror("open");
+		free(trace);
+		return -1;
+	}
+
+	header.block_count = disk->bcount;
+	if (write(trace->fd, &header, sizeof(header)) != sizeof(header)) {
+		perror("write");
+		close(trace->fd);
+		free(trace);
+		return -1;
+	}
+
+	trace->cur = 0;
+	trace->count = 0;
+	trace->writing = 0;
+	trace->waiters = 0;
+	trace->error = 0;
+	trace->start = now_ns();
+
+	pthread_mutex_lock(&disk->trace_lock);
+	if (disk->trace) {
+		pthread_mutex_unlock(&disk->trace_lock);
+		block_error("disk already traced");
+		close(trace->fd);
+		free(trace);
 		return -1;
 	}
+	__atomic_store_n(&disk->trace, trace, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&disk->trace_lock);
 
 	return 0;
 }
 
+int disk_trace_stop(struct disk *disk)
+{
+	struct disk_trace *trace;
+	int ret;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/*
+	 * Requests made from now on find no trace, wait until the ongoing ones
+	 * are done with it
+	 */
+	pthread_mutex_lock(&disk->trace_lock);
+	trace = disk->trace;
+	__atomic_store_n(&disk->trace, NULL, __ATOMIC_RELAXED);
+	while (trace && (trace->writing || trace->waiters)) {
+		pthread_cond_broadcast(&disk->trace_cond);
+		pthread_cond_wait(&disk->trace_cond, &disk->trace_lock);
+	}
+	pthread_mutex_unlock(&disk->trace_lock);
+	if (!trace)
+		return 0;
+
+	ret = trace_write(trace, trace->bufs[trace->cur], trace->count);
+	if (trace->error)
+		ret = -1;
+	if (close(trace->fd)) {
+		perror("close");
+		ret = -1;
+	}
+	free(trace);
+
+	return ret;
+}
+
+void *disk_map(struct disk *disk, size_t block)
+{
+	if (!disk || !disk->map || block >= disk->bcount)
+		return NULL;
+
+	return disk->map + block * BLOCK_SIZE;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_backend(diskname, BLOCK_BACKEND_FILE);
+}
+
+int block_disk_open_backend(const char *diskname, enum block_backend backend)
+{
+	if (block_disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	block_disk = disk_open(diskname, backend);
+
+	return block_disk ? 0 : -1;
+}
+
+int block_disk_close(void)
+{
+	int ret = disk_close(block_disk);
+
+	block_disk = NULL;
+
+	return ret;
+}
+
+int block_disk_sync(void)
+{
+	return disk_sync(block_disk);
+}
+
+int block_disk_count(void)
+{
+	return disk_count(block_disk);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return disk_write(block_disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return disk_read(block_disk, block, buf);
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return disk_writev(block_disk, block, iov, iovcnt);
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return disk_readv(block_disk, block, iov, iovcnt);
+}
+
+int block_queue_write(size_t block, const void *buf)
+{
+	return disk_queue_write(block_disk, block, buf);
+}
+
+int block_queue_read(size_t block, void *buf)
+{
+	return disk_queue_read(block_disk, block, buf);
+}
+
+int block_queue_wait(void)
+{
+	return disk_queue_wait(block_disk);
+}
+
+int block_sched_config(unsigned int deadline_us)
+{
+	return disk_sched_config(block_disk, deadline_us);
+}
+
+int block_trace_start(const char *filename)
+{
+	return disk_trace_start(block_disk, filename);
+}
+
+int block_trace_stop(void)
+{
+	return disk_trace_stop(block_disk);
+}
+
+void *block_map(size_t block)
+{
+	return disk_map(block_disk, block);
+}
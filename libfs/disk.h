@@ -2,10 +2,59 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Maximum number of queued block requests */
+#define BLOCK_QUEUE_DEPTH 64
+
+/** Default dispatch deadline of queued block requests, in microseconds */
+#define BLOCK_SCHED_DEADLINE 1000
+
+/** First bytes of a block request trace file ("BTRC") */
+#define BLOCK_TRACE_MAGIC 0x43525442
+
+/** Operations of block request trace records */
+#define BLOCK_TRACE_READ 0
+#define BLOCK_TRACE_WRITE 1
+
+/* Start of a block request trace file, followed by its records */
+struct __attribute__((packed)) block_trace_header {
+	/* BLOCK_TRACE_MAGIC */
+	uint32_t magic;
+	/* Size of each record */
+	uint16_t record_size;
+	uint16_t unused;
+	/* Number of blocks of the traced virtual disk */
+	uint64_t block_count;
+};
+
+/* Block request of a trace, see block_trace_start() */
+struct __attribute__((packed)) block_trace_record {
+	/* Time of the request since the start of the trace, in nanoseconds */
+	uint64_t time;
+	/* First block and number of consecutive blocks */
+	uint32_t block;
+	uint16_t count;
+	/* BLOCK_TRACE_READ or BLOCK_TRACE_WRITE */
+	uint8_t op;
+	/* Tag of the requesting thread, see disk_thread_tag() */
+	uint8_t tag;
+};
+
+/** Ways of accessing the virtual disk file */
+enum block_backend {
+	/* Positional read and write system calls */
+	BLOCK_BACKEND_FILE,
+	/* Memory mapping of the whole file */
+	BLOCK_BACKEND_MMAP,
+	/* Asynchronous requests through io_uring */
+	BLOCK_BACKEND_URING,
+};
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,6 +68,26 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_backend - Open virtual disk file with a specific backend
+ * @diskname: Name of the virtual disk file
+ * @backend: Backend serving block requests
+ *
+ * Same as block_disk_open(), which uses %BLOCK_BACKEND_FILE, but select how
+ * the blocks of @diskname are accessed. With %BLOCK_BACKEND_MMAP, the whole
+ * file is mapped in memory, block_read() and block_write() become plain memory
+ * copies and block_map() gives direct access to the blocks. With
+ * %BLOCK_BACKEND_URING, requests queued with block_queue_read() and
+ * block_queue_write() are submitted in batches and run concurrently; if the
+ * kernel does not provide io_uring, the disk silently falls back to
+ * %BLOCK_BACKEND_FILE.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, if @backend is invalid or if a virtual disk is already open. 0
+ * otherwise.
+ */
+int block_disk_open_backend(const char *diskname, enum block_backend backend);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +95,20 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Flush virtual disk file
+ *
+ * Make sure that all the blocks written so far have reached the device that
+ * holds the virtual disk file, and are not only in the page cache: blocks
+ * modified in memory with %BLOCK_BACKEND_MMAP are written with msync(), and
+ * the file is flushed with fdatasync() with the other backends. Blocks written
+ * after this returns can therefore not reach the device before them.
+ *
+ * Return: -1 if there was no virtual disk file opened or if flushing fails. 0
+ * otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -60,5 +143,225 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @iov: Array of data buffers to write in the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the content of the @iovcnt buffers described by @iov, one after the
+ * other, in the virtual disk's blocks starting at block @block. The total
+ * length of the buffers must be a multiple of %BLOCK_SIZE. The blocks are
+ * written with as few system calls as possible.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if one of
+ * the blocks is out of bounds or inaccessible or if the writing operation
+ * fails. 0 otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @iov: Array of data buffers to be filled with content of the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read the content of the virtual disk's blocks starting at block @block into
+ * the @iovcnt buffers described by @iov, filling them one after the other. The
+ * total length of the buffers must be a multiple of %BLOCK_SIZE. The blocks are
+ * read with as few system calls as possible.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if one of
+ * the blocks is out of bounds or inaccessible, or if the reading operation
+ * fails. 0 otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_queue_write - Queue a block write
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Queue the writing of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
+ * block @block. The write is only guaranteed to be performed once
+ * block_queue_wait() returns, and @buf must not be modified until then. With
+ * %BLOCK_BACKEND_MMAP, the write is performed right away.
+ *
+ * Queued requests are collected by a scheduler, which dispatches them in block
+ * order and merges the requests for consecutive blocks into single vectored
+ * transfers. They are dispatched by block_queue_wait(), when the queue is full,
+ * or once the oldest of them has been queued for longer than the dispatch
+ * deadline (see block_sched_config()). Requests for the same block are
+ * performed in the order they were queued.
+ *
+ * Return: -1 if there was no virtual disk file opened or if @block is out of
+ * bounds. 0 otherwise. Failures of the write itself are reported by
+ * block_queue_wait().
+ */
+int block_queue_write(size_t block, const void *buf);
+
+/**
+ * block_queue_read - Queue a block read
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Queue the reading of the virtual disk's block @block (%BLOCK_SIZE bytes) into
+ * buffer @buf, which is only guaranteed to be filled once block_queue_wait()
+ * returns. With %BLOCK_BACKEND_MMAP, the read is performed right away.
+ * Otherwise, the request is scheduled like the ones of block_queue_write().
+ *
+ * Return: -1 if there was no virtual disk file opened or if @block is out of
+ * bounds. 0 otherwise. Failures of the read itself are reported by
+ * block_queue_wait().
+ */
+int block_queue_read(size_t block, void *buf);
+
+/**
+ * block_queue_wait - Wait for queued block requests
+ *
+ * Dispatch all the queued requests and wait until they are all completed.
+ * Requests queued by other threads are performed too, but their failures are
+ * only reported to the threads that queued them: a thread must wait for its
+ * own requests before it exits.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if any request
+ * queued by the calling thread since its previous call failed. 0 otherwise.
+ */
+int block_queue_wait(void);
+
+/**
+ * block_sched_config - Set the dispatch deadline of queued requests
+ * @deadline_us: Microseconds a queued request can wait for others to merge with
+ *
+ * Queued requests are held back for at most @deadline_us microseconds, checked
+ * whenever another request is queued, %BLOCK_SCHED_DEADLINE by default. With a
+ * deadline of 0, requests are dispatched as soon as they are queued, in call
+ * order.
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_sched_config(unsigned int deadline_us);
+
+/**
+ * block_trace_start - Start recording block requests
+ * @filename: Name of the trace file, created or truncated
+ *
+ * From now on, append a record to trace file @filename for every block request
+ * made with the read and write functions, immediate, vectored or queued: its
+ * time, operation, blocks, and the tag of the requesting thread. Records are
+ * buffered in memory and written in batches, the last ones by
+ * block_trace_stop() or block_disk_close(). Accesses through block_map() are
+ * not recorded. Recording can start and stop while other threads make
+ * requests, which are recorded or not depending on which comes first.
+ *
+ * Return: -1 if there was no virtual disk file opened, if it is already traced
+ * or if @filename cannot be created. 0 otherwise.
+ */
+int block_trace_start(const char *filename);
+
+/**
+ * block_trace_stop - Stop recording block requests
+ *
+ * Return: -1 if there was no virtual disk file opened or if the last records
+ * cannot be written. 0 otherwise, or if the disk was not traced.
+ */
+int block_trace_stop(void);
+
+/**
+ * block_map - Get direct access to a block
+ * @block: Index of the block
+ *
+ * Return the address of block @block (%BLOCK_SIZE bytes) in the mapping of the
+ * virtual disk file. Modifying the block through this address is the same as
+ * writing it with block_write(). The address is valid until the virtual disk
+ * is closed.
+ *
+ * Return: NULL if there was no virtual disk file opened, if the disk was not
+ * opened with %BLOCK_BACKEND_MMAP or if @block is out of bounds. Otherwise,
+ * return the address of the block.
+ */
+void *block_map(size_t block);
+
+/*
+ * Virtual disk instances: the block_*() functions above work on the single
+ * virtual disk opened with block_disk_open(). Any number of virtual disks can be
+ * open at the same time as instances, each accessed with the disk_*() function
+ * matching a block_*() function, which takes the instance as first argument.
+ * Different instances share no state.
+ */
+struct disk;
+
+/**
+ * disk_open - Open a virtual disk instance
+ * @diskname: Name of the virtual disk file
+ * @backend: Backend serving block requests
+ *
+ * Same as block_disk_open_backend(), without the limit of one open disk.
+ *
+ * Return: NULL if @diskname is invalid, if the virtual disk file cannot be
+ * opened or mapped, or if @backend is invalid. Otherwise, return the instance.
+ */
+struct disk *disk_open(const char *diskname, enum block_backend backend);
+
+/**
+ * disk_close - Close a virtual disk instance
+ * @disk: Instance to close, released on return
+ *
+ * Return: -1 if @disk is NULL. 0 otherwise.
+ */
+int disk_close(struct disk *disk);
+
+/* Same as block_disk_sync() and block_disk_count(), on @disk */
+int disk_sync(struct disk *disk);
+int disk_count(struct disk *disk);
+
+/* Same as block_write() and block_read(), on @disk */
+int disk_write(struct disk *disk, size_t block, const void *buf);
+int disk_read(struct disk *disk, size_t block, void *buf);
+
+/* Same as block_writev() and block_readv(), on @disk */
+int disk_writev(struct disk *disk, size_t block, const struct iovec *iov,
+		int iovcnt);
+int disk_readv(struct disk *disk, size_t block, const struct iovec *iov,
+	       int iovcnt);
+
+/*
+ * Same as block_queue_write(), block_queue_read() and block_queue_wait(), on
+ * @disk. Each instance has its own queue.
+ */
+int disk_queue_write(struct disk *disk, size_t block, const void *buf);
+int disk_queue_read(struct disk *disk, size_t block, void *buf);
+int disk_queue_wait(struct disk *disk);
+
+/* Same as block_sched_config(), on @disk */
+int disk_sched_config(struct disk *disk, unsigned int deadline_us);
+
+/* Same as block_trace_start() and block_trace_stop(), on @disk */
+int disk_trace_start(struct disk *disk, const char *filename);
+int disk_trace_stop(struct disk *disk);
+
+/* Same as block_map(), on @disk */
+void *disk_map(struct disk *disk, size_t block);
+
+/**
+ * disk_thread_io - Count the blocks requested by the calling thread
+ * @reads: Set to the number of blocks read so far
+ * @writes: Set to the number of blocks written so far
+ *
+ * Every block passed to the read and write functions above, immediate or
+ * queued, is counted once by the thread that requests it, whatever the disk.
+ * Accesses through block_map() are not counted.
+ */
+void disk_thread_io(size_t *reads, size_t *writes);
+
+/**
+ * disk_thread_tag - Tag the requests of the calling thread
+ * @tag: Value between 0 and 255, recorded in block request traces
+ *
+ * Tag the requests that the calling thread makes from now on, so that traces
+ * tell which higher-level operation made them. Threads start with tag 0.
+ */
+void disk_thread_tag(int tag);
+
 #endif /* _DISK_H */
 
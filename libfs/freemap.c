@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freemap.h"
+
+#define WORD_BITS 64
+
+static size_t nwords(size_t nbits)
+{
+	return (nbits + WORD_BITS - 1) / WORD_BITS;
+}
+
+int freemap_init(struct freemap *map, size_t count)
+{
+	map->count = count;
+	map->nfree = 0;
+	map->bits = calloc(nwords(count) ? nwords(count) : 1, sizeof(uint64_t));
+	map->summary = calloc(nwords(nwords(count)) ? nwords(nwords(count)) : 1,
+			      sizeof(uint64_t));
+	if (!map->bits || !map->summary) {
+		freemap_destroy(map);
+		return -1;
+	}
+
+	return 0;
+}
+
+void freemap_destroy(struct freemap *map)
+{
+	free(map->bits);
+	free(map->summary);
+	memset(map, 0, sizeof(*map));
+}
+
+void freemap_set(struct freemap *map, size_t block, int is_free)
+{
+	size_t w = block / WORD_BITS;
+	uint64_t mask = (uint64_t)1 << (block % WORD_BITS);
+
+	if (block >= map->count || !!(map->bits[w] & mask) == !!is_free)
+		return;
+
+	if (is_free) {
+		map->bits[w] |= mask;
+		map->nfree++;
+	} else {
+		map->bits[w] &= ~mask;
+		map->nfree--;
+	}
+
+	mask = (uint64_t)1 << (w % WORD_BITS);
+	if (map->bits[w])
+		map->summary[w / WORD_BITS] |= mask;
+	else
+		map->summary[w / WORD_BITS] &= ~mask;
+}
+
+long freemap_first(const struct freemap *map, size_t from)
+{
+	size_t w, s;
+	uint64_t word;
+
+	if (from >= map->count)
+		return -1;
+
+	/* Rest of the word @from falls in */
+	w = from / WORD_BITS;
+	word = map->bits[w] & (~(uint64_t)0 << (from % WORD_BITS));
+	if (word)
+		goto found;
+
+	/* Rest of the summary word, then following summary words */
+	w++;
+	s = w / WORD_BITS;
+	if (w % WORD_BITS) {
+		uint64_t sum = map->summary[s] & (~(uint64_t)0 << (w % WORD_BITS));
+
+		if (sum) {
+			w = s * WORD_BITS + __builtin_ctzll(sum);
+			word = map->bits[w];
+			goto found;
+		}
+		s++;
+	}
+
+	for (; s < nwords(nwords(map->count)); s++) {
+		if (map->summary[s]) {
+			w = s * WORD_BITS + __builtin_ctzll(map->summary[s]);
+			word = map->bits[w];
+			goto found;
+		}
+	}
+
+	return -1;
+
+found:
+	return w * WORD_BITS + __builtin_ctzll(word);
+}
+
+long freemap_first_run(const struct freemap *map, size_t from, size_t len)
+{
+	long start;
+
+	while ((start = freemap_first(map, from)) != -1) {
+		size_t end = start + 1;
+
+		while (end < map->count && end - start < len &&
+		       (map->bits[end / WORD_BITS] >> (end % WORD_BITS) & 1))
+			end++;
+
+		if (end - start >= len)
+			return start;
+
+		/* Block @end is used (or past the end), resume after it */
+		from = end + 1;
+	}
+
+	return -1;
+}
@@ -0,0 +1,67 @@
+#ifndef _FREEMAP_H
+#define _FREEMAP_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/*
+ * Free-space index: one bit per block, set when the block is free, and one
+ * summary bit per 64-bit word, set when the word has at least one free block.
+ */
+struct freemap {
+	/* Number of blocks tracked */
+	size_t count;
+	/* Number of free blocks */
+	size_t nfree;
+	/* Free blocks, and words of @bits that have free blocks */
+	uint64_t *bits;
+	uint64_t *summary;
+};
+
+/**
+ * freemap_init - Set up a free-space index
+ * @map: Index to set up
+ * @count: Number of blocks to track
+ *
+ * All the blocks start as used.
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+int freemap_init(struct freemap *map, size_t count);
+
+/**
+ * freemap_destroy - Release a free-space index
+ * @map: Index to release
+ */
+void freemap_destroy(struct freemap *map);
+
+/**
+ * freemap_set - Mark a block as free or used
+ * @map: Free-space index
+ * @block: Index of the block
+ * @is_free: Mark @block free if non-zero, used otherwise
+ */
+void freemap_set(struct freemap *map, size_t block, int is_free);
+
+/**
+ * freemap_first - Find the first free block
+ * @map: Free-space index
+ * @from: Index of the first block to consider
+ *
+ * Return: -1 if there is no free block at or after @from. Otherwise, return the
+ * lowest index of a free block that is not lower than @from.
+ */
+long freemap_first(const struct freemap *map, size_t from);
+
+/**
+ * freemap_first_run - Find the first run of consecutive free blocks
+ * @map: Free-space index
+ * @from: Index of the first block to consider
+ * @len: Number of consecutive free blocks wanted
+ *
+ * Return: -1 if there is no run of @len free blocks at or after @from.
+ * Otherwise, return the index of the first block of the lowest such run.
+ */
+long freemap_first_run(const struct freemap *map, size_t from, size_t len);
+
+#endif /* _FREEMAP_H */
@@ -1,12 +1,32 @@
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include "cache.h"
 #include "disk.h"
+#include "freemap.h"
 #include "fs.h"
 #define FAT_EOC 0xFFFF
 #define AVAILABLE 0
+/* Number of buckets of the filename index, a power of two */
+#define DIR_HASH_SIZE (2 * FS_FILE_MAX_COUNT)
+#define DIR_HASH_EMPTY -1
+/* Initial readahead window of a descriptor, in blocks */
+#define READAHEAD_MIN 4
+/* Superblock free space counters are up to date ("CNTR") */
+#define COUNTERS_VALID 0x52544E43
+/* Superblock describes a metadata journal ("JRNL") */
+#define JOURNAL_VALID 0x4C4E524A
+/* Start of a journal transaction ("TXN ") */
+#define JOURNAL_TXN 0x204E5854
+/* Types of journal records */
+#define JOURNAL_FAT 1
+#define JOURNAL_ROOT 2
 
 struct __attribute__((packed)) super_block
 {
@@ -17,7 +37,17 @@ struct __attribute__((packed)) super_block
 	uint16_t data_start_index;
 	uint16_t num_data_blocks;
 	uint8_t num_FAT_blocks;
-	uint8_t unused[4079];
+	/* Free space counters, only trusted when counters_valid is COUNTERS_VALID and root_checksum matches the root directory */
+	uint32_t counters_valid;
+	uint16_t free_data_blocks;
+	uint8_t free_root_entries;
+	uint32_t root_checksum;
+	/* Metadata journal, only present when journal_valid is JOURNAL_VALID: data blocks it occupies, and sequence number of its first transaction still to replay */
+	uint32_t journal_valid;
+	uint16_t journal_start;
+	uint16_t journal_blocks;
+	uint32_t journal_seq;
+	uint8_t unused[4056];
 };
 
 struct __attribute__((packed)) entry
@@ -41,719 +71,2953 @@ struct __attribute__((packed)) FAT
 	uint16_t *entries_fat;
 };
 
-struct __attribute__((packed)) file
+/* In-memory only, no need to pack the descriptors */
+struct file
 {
-	uint8_t filename[FS_FILENAME_LEN];
+	/* Protects the rest of the descriptor */
+	pthread_mutex_t lock;
+	/* Position of the file in the root directory, -1 if the descriptor is not open */
+	int pos_entry;
 	size_t file_offset;
+	/* Sequential access detection: offset the next read is expected at, readahead window in blocks, end of what was read ahead */
+	size_t ra_next;
+	size_t ra_window;
+	size_t ra_end;
+	/* Block buffer for the unaligned head and tail of transfers, allocated on first use */
+	uint8_t *scratch;
+};
+
+struct file_descriptor_table
+{
+	size_t num_open_file;
+	/* Number of descriptors, set at mount */
+	size_t max_open_file;
+	struct file *file_t;
+	/* Descriptors that are not open */
+	struct freemap free_fds;
+	/* Number of descriptors open on each root directory entry */
+	uint16_t open_count[FS_FILE_MAX_COUNT];
+};
+
+/* Transaction of the journal, followed by its records and padded to whole blocks */
+struct __attribute__((packed)) journal_header
+{
+	uint32_t magic;
+	uint32_t seq;
+	/* Size of the records, in bytes */
+	uint32_t length;
+	/* FNV-1a of the header (with checksum 0) and the records, to detect torn transactions */
+	uint32_t checksum;
+};
+
+/* New value of a FAT entry */
+struct __attribute__((packed)) journal_fat_record
+{
+	uint8_t type;
+	uint16_t index;
+	uint16_t value;
+};
+
+/* New content of a root directory entry */
+struct __attribute__((packed)) journal_root_record
+{
+	uint8_t type;
+	uint8_t pos;
+	struct entry entry;
+};
+
+/* Data blocks of a file in file order, filled from the FAT chain on demand */
+struct block_map
+{
+	uint16_t *blocks;
+	size_t count;
+	size_t capacity;
+};
+
+/* Filename index of the root directory, open addressing with linear probing */
+struct dir_index
+{
+	/* Position of an entry in the root directory, or DIR_HASH_EMPTY */
+	int16_t buckets[DIR_HASH_SIZE];
+	/* Empty entries of the root directory */
+	struct freemap free_entries;
+};
+
+/* Metadata blocks modified since they were last written to disk */
+struct dirty_metadata
+{
+	/* One flag per FAT block */
+	uint8_t fat[UINT8_MAX];
+	uint8_t root;
+	uint8_t super;
+};
+
+/* Number of blocks the block cache is set up with at mount */
+size_t cache_blocks = CACHE_DEFAULT_BLOCKS;
+
+/* Block layer backend the disk is opened with at mount */
+enum block_backend disk_backend = BLOCK_BACKEND_FILE;
+
+/* Dispatch deadline of the disk request scheduler, in microseconds */
+unsigned int sched_deadline = BLOCK_SCHED_DEADLINE;
+
+/* File the block requests are traced to from mount, none if NULL */
+char *trace_file = NULL;
+
+/* Number of file descriptors available once mounted */
+size_t open_max = FS_OPEN_MAX_COUNT;
+
+/* Size of the journal set up at mount on disks without one, none if 0 */
+size_t journal_size = 0;
+
+/* Milliseconds between two group commits of the journal, none if 0 */
+unsigned int journal_interval = FS_JOURNAL_INTERVAL;
+
+/* Metadata journal of a mounted file system */
+struct journal
+{
+	/* First data block and number of blocks, 0 blocks if the disk has no journal */
+	uint16_t start;
+	uint16_t blocks;
+	/* Block the next transaction goes to, and its sequence number */
+	size_t head;
+	uint32_t seq;
+	/* Largest possible transaction, in blocks: there is always room for one, to commit everything before a checkpoint */
+	size_t reserve;
+	/* Transaction being built, reserve blocks */
+	uint8_t *buf;
+	/* FAT entries changed since the last commit */
+	struct freemap fat_dirty;
+	/* Data blocks freed since the last commit, only reused once it frees them: until then, a crash brings their owner back */
+	struct freemap pending_free;
+	/* Root directory as of the last commit */
+	struct root_directory root;
+	/* Group commit thread, woken up early to stop */
+	pthread_t thread;
+	int running;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+/* Mounted file system, nothing is shared between instances */
+struct fs
+{
+	struct super_block super_t;
+	struct root_directory root_t;
+	struct FAT fat_t;
+	struct file_descriptor_table file_des_table;
+	/* Free data blocks, mirrors the AVAILABLE entries of the FAT */
+	struct freemap free_map;
+	/* Block map of each file of the root directory */
+	struct block_map block_maps[FS_FILE_MAX_COUNT];
+	struct dir_index dir_index;
+	struct dirty_metadata meta_dirty;
+	struct journal journal;
+	/* Root directory entry the next fs_defrag() starts at, under the metadata lock */
+	int defrag_next;
+	/* Virtual disk and block cache the file system lives on */
+	struct disk *disk;
+	struct cache *cache;
+
+	/*
+	 * Locks, taken in this order when nested: directory, descriptor, file,
+	 * metadata, block map. The descriptor table has its own lock, taken last.
+	 */
+	/* Names and entries of the root directory: shared by lookups, exclusive for creation and deletion */
+	pthread_rwlock_t dir_lock;
+	/* Size, data blocks and contents of each file: shared by readers, exclusive for writers (which also lock the metadata to change the size or the first block) */
+	pthread_rwlock_t file_locks[FS_FILE_MAX_COUNT];
+	/* FAT, index of free data blocks, superblock counters, dirty flags and journal */
+	pthread_mutex_t meta_lock;
+	/* Block map of each file, extended by readers as well */
+	pthread_mutex_t map_locks[FS_FILE_MAX_COUNT];
+	/* Free descriptors and open counts */
+	pthread_mutex_t fd_lock;
+};
+
+/* Instance behind the functions that do not take one, set by fs_mount() */
+fs_t *default_fs;
+
+/* Counters of the public operations, shared by all the instances and only updated atomically */
+struct fs_stats op_stats;
+
+/* Start of a counted operation: time, and blocks transferred by the thread so far */
+struct op_probe
+{
+	uint64_t start;
+	size_t reads;
+	size_t writes;
 };
 
-struct __attribute__((packed)) file_descriptor_table
-{
-	size_t num_open_file;
-	struct file file_t[FS_OPEN_MAX_COUNT];
-};
+uint64_t stats_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Starts counting operation op, whose block requests are tagged with op + 1 in traces */
+void stats_begin(struct op_probe *probe, int op)
+{
+	probe->start = stats_clock();
+	disk_thread_io(&probe->reads, &probe->writes);
+	disk_thread_tag(op + 1);
+}
+
+/* Counts operation op, started with probe, which returned ret */
+void stats_end(const struct op_probe *probe, int op, long ret)
+{
+	struct fs_op_stats *stats = &op_stats.ops[op];
+	uint64_t elapsed = stats_clock() - probe->start;
+	size_t reads, writes;
+	disk_thread_io(&reads, &writes);
+
+	/* Bucket i holds the latencies whose highest bit set is bit i */
+	int bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+	if (bucket >= FS_LATENCY_BUCKETS)
+	{
+		bucket = FS_LATENCY_BUCKETS - 1;
+	}
+
+	__atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+	if ((op == FS_OP_READ || op == FS_OP_WRITE) && ret > 0)
+	{
+		__atomic_fetch_add(&stats->bytes, ret, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&stats->total_ns, elapsed, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->block_reads, reads - probe->reads, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->block_writes, writes - probe->writes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->latency[bucket], 1, __ATOMIC_RELAXED);
+	disk_thread_tag(0);
+}
+
+/* Sets an entry of the FAT, keeping the index of free blocks up to date. Metadata must be locked */
+void fat_set(struct fs *fs, uint16_t index, uint16_t value) {
+	/* Keep the free data block counter up to date */
+	if ((fs->fat_t.entries_fat[index] == AVAILABLE) != (value == AVAILABLE)) {
+		fs->super_t.free_data_blocks += (value == AVAILABLE) ? 1 : -1;
+		fs->meta_dirty.super = 1;
+	}
+	fs->fat_t.entries_fat[index] = value;
+	fs->meta_dirty.fat[index / (BLOCK_SIZE / sizeof(uint16_t))] = 1;
+	int pending = 0;
+	if (fs->journal.blocks) {
+		freemap_set(&fs->journal.fat_dirty, index, 1);
+		pending = (value == AVAILABLE);
+		freemap_set(&fs->journal.pending_free, index, pending);
+	}
+	/* The index of free blocks may not be built yet */
+	if (fs->free_map.bits) {
+		freemap_set(&fs->free_map, index, value == AVAILABLE && !pending);
+	}
+}
+/* Builds the index of free data blocks from the FAT, leaving out the ones whose freeing is not committed yet */
+int build_free_map(struct fs *fs) {
+	if (freemap_init(&fs->free_map, fs->super_t.num_data_blocks) == -1) {
+		return -1;
+	}
+	for (int i = 1; i < fs->super_t.num_data_blocks; i++) {
+		if (fs->fat_t.entries_fat[i] == AVAILABLE && !(fs->journal.blocks && freemap_first(&fs->journal.pending_free, i) == i)) {
+			freemap_set(&fs->free_map, i, 1);
+		}
+	}
+	return 0;
+}
+/* Checksums the root directory (FNV-1a), to detect changes made by other implementations */
+uint32_t root_checksum(struct fs *fs) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < sizeof(fs->root_t); i++) {
+		hash = (hash ^ ((uint8_t *)&fs->root_t)[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/* Gets and locks an open file descriptor, NULL if fs is not mounted or fd is invalid or not open */
+struct file *lock_file(struct fs *fs, int fd)
+{
+	if (fs == NULL || fd < 0 || (size_t)fd >= fs->file_des_table.max_open_file)
+	{
+		return NULL;
+	}
+
+	struct file *file = &fs->file_des_table.file_t[fd];
+	pthread_mutex_lock(&file->lock);
+	if (file->pos_entry == -1)
+	{
+		pthread_mutex_unlock(&file->lock);
+		return NULL;
+	}
+
+	return file;
+}
+
+/* Gets the scratch block of an open file descriptor, NULL if it cannot be allocated */
+uint8_t *get_scratch(struct file *file)
+{
+	if (file->scratch == NULL)
+	{
+		file->scratch = malloc(BLOCK_SIZE);
+	}
+
+	return file->scratch;
+}
+
+/* Adds a data block at the end of a file's block map */
+int map_append(struct block_map *map, uint16_t index)
+{
+	if (map->count == map->capacity)
+	{
+		size_t capacity = map->capacity ? map->capacity * 2 : 16;
+		uint16_t *blocks = realloc(map->blocks, capacity * sizeof(uint16_t));
+		if (blocks == NULL)
+		{
+			return -1;
+		}
+		map->blocks = blocks;
+		map->capacity = capacity;
+	}
+
+	map->blocks[map->count++] = index;
+
+	return 0;
+}
+/* Forgets a file's block map, it is rebuilt from the FAT when needed */
+void map_reset(struct fs *fs, int pos_entry)
+{
+	free(fs->block_maps[pos_entry].blocks);
+	memset(&fs->block_maps[pos_entry], 0, sizeof(struct block_map));
+}
+
+/* Hashes a filename (FNV-1a) into a bucket of the filename index */
+size_t dir_hash(const char *filename)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < FS_FILENAME_LEN && filename[i] != '\0'; i++)
+	{
+		hash = (hash ^ (uint8_t)filename[i]) * 16777619u;
+	}
+
+	return hash & (DIR_HASH_SIZE - 1);
+}
+/* Gets the position of a file in the root directory, -1 if there is none */
+int dir_lookup(struct fs *fs, const char *filename)
+{
+	size_t bucket = dir_hash(filename);
+	while (fs->dir_index.buckets[bucket] != DIR_HASH_EMPTY)
+	{
+		int pos = fs->dir_index.buckets[bucket];
+		if (strncmp((char *)fs->root_t.entries_root[pos].filename, filename, FS_FILENAME_LEN) == 0)
+		{
+			return pos;
+		}
+		bucket = (bucket + 1) & (DIR_HASH_SIZE - 1);
+	}
+
+	return -1;
+}
+/* Indexes the root directory entry at pos under its filename */
+void dir_insert(struct fs *fs, int pos)
+{
+	size_t bucket = dir_hash((char *)fs->root_t.entries_root[pos].filename);
+	while (fs->dir_index.buckets[bucket] != DIR_HASH_EMPTY)
+	{
+		bucket = (bucket + 1) & (DIR_HASH_SIZE - 1);
+	}
+	fs->dir_index.buckets[bucket] = pos;
+	freemap_set(&fs->dir_index.free_entries, pos, 0);
+}
+/* Removes the root directory entry at pos from the index, before its filename is cleared */
+void dir_remove(struct fs *fs, int pos)
+{
+	size_t hole = dir_hash((char *)fs->root_t.entries_root[pos].filename);
+	while (fs->dir_index.buckets[hole] != pos)
+	{
+		hole = (hole + 1) & (DIR_HASH_SIZE - 1);
+	}
+
+	/* Shift the following entries of the probe sequence back instead of leaving a tombstone */
+	size_t bucket = hole;
+	for (;;)
+	{
+		bucket = (bucket + 1) & (DIR_HASH_SIZE - 1);
+		if (fs->dir_index.buckets[bucket] == DIR_HASH_EMPTY)
+		{
+			break;
+		}
+		size_t home = dir_hash((char *)fs->root_t.entries_root[fs->dir_index.buckets[bucket]].filename);
+		/* Entries whose home bucket lies cyclically in (hole, bucket] stay put */
+		if (((bucket - home) & (DIR_HASH_SIZE - 1)) >= ((bucket - hole) & (DIR_HASH_SIZE - 1)))
+		{
+			fs->dir_index.buckets[hole] = fs->dir_index.buckets[bucket];
+			hole = bucket;
+		}
+	}
+	fs->dir_index.buckets[hole] = DIR_HASH_EMPTY;
+	freemap_set(&fs->dir_index.free_entries, pos, 1);
+}
+
+/* Helper of fs_sync() and journal_checkpoint(): writes the modified metadata blocks home, with the metadata locked */
+int write_metadata(struct fs *fs)
+{
+	/* Data blocks first, so that the metadata on disk never refers to unwritten blocks */
+	if (cache_flush(fs->cache) == -1)
+	{
+		return -1;
+	}
+
+	/* The dirty blocks are queued so that the disk scheduler merges the consecutive ones, unless the FAT is mapped and already modified in place */
+	int fat_mapped = (fs->fat_t.entries_fat == disk_map(fs->disk, 1));
+	int ret = 0;
+	for (int i = 0; i < fs->super_t.num_FAT_blocks; i++)
+	{
+		if (fs->meta_dirty.fat[i] && !fat_mapped && disk_queue_write(fs->disk, 1 + i, (uint8_t *)fs->fat_t.entries_fat + i * BLOCK_SIZE) == -1)
+		{
+			ret = -1;
+		}
+	}
+
+	if (fs->meta_dirty.root)
+	{
+		if (disk_queue_write(fs->disk, fs->super_t.root_dir_index, &fs->root_t) == -1)
+		{
+			ret = -1;
+		}
+
+		/* The counters are only trusted along with the root directory they were saved with */
+		fs->super_t.root_checksum = root_checksum(fs);
+		fs->meta_dirty.super = 1;
+	}
+
+	if (fs->meta_dirty.super && disk_queue_write(fs->disk, 0, &fs->super_t) == -1)
+	{
+		ret = -1;
+	}
+
+	if (disk_queue_wait(fs->disk) == -1 || ret == -1)
+	{
+		return -1;
+	}
+
+	memset(fs->meta_dirty.fat, 0, fs->super_t.num_FAT_blocks);
+	fs->meta_dirty.root = 0;
+	fs->meta_dirty.super = 0;
+
+	return disk_sync(fs->disk);
+}
+
+/* Largest possible journal transaction in blocks, with every FAT and root directory entry changed */
+size_t journal_reserve(struct fs *fs)
+{
+	size_t length = sizeof(struct journal_header) + FS_FILE_MAX_COUNT * sizeof(struct journal_root_record) + fs->super_t.num_data_blocks * sizeof(struct journal_fat_record);
+
+	return (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+/* Checksums a journal transaction (FNV-1a) with length bytes of records, its checksum field must be 0 */
+uint32_t journal_checksum(const uint8_t *txn, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < sizeof(struct journal_header) + length; i++)
+	{
+		hash = (hash ^ txn[i]) * 16777619u;
+	}
+	return hash;
+}
+/* Sets up the journal in memory, over blocks data blocks from start, -1 if they do not fit the disk */
+int journal_init(struct fs *fs, uint16_t start, uint16_t blocks)
+{
+	struct journal *journal = &fs->journal;
+
+	journal->reserve = journal_reserve(fs);
+	if (start == 0 || (size_t)start + blocks > fs->super_t.num_data_blocks || blocks < journal->reserve)
+	{
+		return -1;
+	}
+
+	journal->buf = malloc(journal->reserve * BLOCK_SIZE);
+	if (journal->buf == NULL || freemap_init(&journal->fat_dirty, fs->super_t.num_data_blocks) == -1 || freemap_init(&journal->pending_free, fs->super_t.num_data_blocks) == -1)
+	{
+		return -1;
+	}
+	memcpy(&journal->root, &fs->root_t, sizeof(fs->root_t));
+	journal->head = 0;
+	journal->seq = fs->super_t.journal_seq;
+	journal->start = start;
+	journal->blocks = blocks;
+
+	return 0;
+}
+/* Applies the transactions committed to the journal to the metadata read from disk, returns how many or -1 */
+int journal_replay(struct fs *fs)
+{
+	struct journal *journal = &fs->journal;
+	struct journal_header *header = (struct journal_header *)journal->buf;
+	int count = 0;
+
+	/* Transactions follow each other from the start of the journal, the first one that is stale or torn ends it */
+	while (journal->head < journal->blocks)
+	{
+		size_t block = fs->super_t.data_start_index + journal->start + journal->head;
+		if (disk_read(fs->disk, block, journal->buf) == -1)
+		{
+			return -1;
+		}
+
+		if (header->magic != JOURNAL_TXN || header->seq != journal->seq || header->length > journal->reserve * BLOCK_SIZE - sizeof(struct journal_header))
+		{
+			break;
+		}
+		size_t nblocks = (sizeof(struct journal_header) + header->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if (journal->head + nblocks > journal->blocks)
+		{
+			break;
+		}
+		if (nblocks > 1)
+		{
+			struct iovec iov = {.iov_base = journal->buf + BLOCK_SIZE, .iov_len = (nblocks - 1) * BLOCK_SIZE};
+			if (disk_readv(fs->disk, block + 1, &iov, 1) == -1)
+			{
+				return -1;
+			}
+		}
+		uint32_t checksum = header->checksum;
+		header->checksum = 0;
+		if (journal_checksum(journal->buf, header->length) != checksum)
+		{
+			break;
+		}
+
+		/* Records hold new values, applying them again is harmless */
+		uint8_t *record = journal->buf + sizeof(struct journal_header);
+		uint8_t *end = record + header->length;
+		while (record < end)
+		{
+			if (*record == JOURNAL_FAT && record + sizeof(struct journal_fat_record) <= end)
+			{
+				struct journal_fat_record fat_record;
+				memcpy(&fat_record, record, sizeof(fat_record));
+				if (fat_record.index < fs->super_t.num_data_blocks)
+				{
+					fs->fat_t.entries_fat[fat_record.index] = fat_record.value;
+					fs->meta_dirty.fat[fat_record.index / (BLOCK_SIZE / sizeof(uint16_t))] = 1;
+				}
+				record += sizeof(fat_record);
+			}
+			else if (*record == JOURNAL_ROOT && record + sizeof(struct journal_root_record) <= end)
+			{
+				struct journal_root_record root_record;
+				memcpy(&root_record, record, sizeof(root_record));
+				if (root_record.pos < FS_FILE_MAX_COUNT)
+				{
+					fs->root_t.entries_root[root_record.pos] = root_record.entry;
+					fs->meta_dirty.root = 1;
+				}
+				record += sizeof(root_record);
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		journal->head += nblocks;
+		journal->seq++;
+		count++;
+	}
+
+	/* The replayed root directory is the last committed one */
+	memcpy(&journal->root, &fs->root_t, sizeof(fs->root_t));
+
+	return count;
+}
+/* Writes the metadata changed since the last commit to the journal as one transaction, with the metadata locked (root directory entries only change with it held) */
+int journal_log(struct fs *fs)
+{
+	struct journal *journal = &fs->journal;
+	struct journal_header *header = (struct journal_header *)journal->buf;
+	uint8_t *records = journal->buf + sizeof(struct journal_header);
+	size_t length = 0;
+
+	/* Root directory entries that differ from the last commit, then FAT entries set since */
+	for (int pos = 0; pos < FS_FILE_MAX_COUNT; pos++)
+	{
+		if (memcmp(&fs->root_t.entries_root[pos], &journal->root.entries_root[pos], sizeof(struct entry)) != 0)
+		{
+			struct journal_root_record root_record = {.type = JOURNAL_ROOT, .pos = pos, .entry = fs->root_t.entries_root[pos]};
+			memcpy(records + length, &root_record, sizeof(root_record));
+			length += sizeof(root_record);
+		}
+	}
+	for (long index = freemap_first(&journal->fat_dirty, 0); index != -1; index = freemap_first(&journal->fat_dirty, index + 1))
+	{
+		struct journal_fat_record fat_record = {.type = JOURNAL_FAT, .index = index, .value = fs->fat_t.entries_fat[index]};
+		memcpy(records + length, &fat_record, sizeof(fat_record));
+		length += sizeof(fat_record);
+	}
+	if (length == 0)
+	{
+		return 0;
+	}
+
+	/* Data blocks first, so that the committed metadata never refers to unwritten blocks */
+	if (cache_flush(fs->cache) == -1 || disk_sync(fs->disk) == -1)
+	{
+		return -1;
+	}
+
+	size_t nblocks = (sizeof(struct journal_header) + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (journal->head + nblocks > journal->blocks)
+	{
+		return -1;
+	}
+	memset(records + length, 0, nblocks * BLOCK_SIZE - sizeof(struct journal_header) - length);
+	header->magic = JOURNAL_TXN;
+	header->seq = journal->seq;
+	header->length = length;
+	header->checksum = 0;
+	header->checksum = journal_checksum(journal->buf, length);
+
+	struct iovec iov = {.iov_base = journal->buf, .iov_len = nblocks * BLOCK_SIZE};
+	if (disk_writev(fs->disk, fs->super_t.data_start_index + journal->start + journal->head, &iov, 1) == -1 || disk_sync(fs->disk) == -1)
+	{
+		return -1;
+	}
+	journal->head += nblocks;
+	journal->seq++;
+
+	/* Everything up to now is committed, the blocks it frees can be reused */
+	for (long index = freemap_first(&journal->fat_dirty, 0); index != -1; index = freemap_first(&journal->fat_dirty, index + 1))
+	{
+		freemap_set(&journal->fat_dirty, index, 0);
+	}
+	for (long index = freemap_first(&journal->pending_free, 0); index != -1; index = freemap_first(&journal->pending_free, index + 1))
+	{
+		freemap_set(&journal->pending_free, index, 0);
+		if (fs->free_map.bits)
+		{
+			freemap_set(&fs->free_map, index, 1);
+		}
+	}
+	memcpy(&journal->root, &fs->root_t, sizeof(fs->root_t));
+
+	return 0;
+}
+/* Writes all the metadata home and empties the journal, with the metadata locked */
+int journal_checkpoint(struct fs *fs)
+{
+	/* Commit everything first: if writing home is interrupted, replaying the journal completes it */
+	if (journal_log(fs) == -1 || write_metadata(fs) == -1)
+	{
+		return -1;
+	}
+
+	/* Only then retire the transactions written so far */
+	fs->super_t.journal_seq = fs->journal.seq;
+	if (disk_write(fs->disk, 0, &fs->super_t) == -1 || disk_sync(fs->disk) == -1)
+	{
+		return -1;
+	}
+	fs->journal.head = 0;
+
+	return 0;
+}
+/* Commits the metadata changed since the last commit, with the metadata locked */
+int journal_commit(struct fs *fs)
+{
+	if (journal_log(fs) == -1)
+	{
+		return -1;
+	}
+
+	/* Checkpoint while there is still room to commit everything beforehand */
+	if (fs->journal.blocks - fs->journal.head < fs->journal.reserve)
+	{
+		return journal_checkpoint(fs);
+	}
+
+	return 0;
+}
+/* Allocates a journal of at least nblocks data blocks at the end of the disk, and records it in the superblock */
+int journal_create(struct fs *fs, size_t nblocks)
+{
+	/* Room for at least two of the largest transactions */
+	if (nblocks < 2 * journal_reserve(fs))
+	{
+		nblocks = 2 * journal_reserve(fs);
+	}
+
+	/* Last run of free data blocks long enough */
+	long start = -1;
+	size_t run = 0;
+	for (long i = fs->super_t.num_data_blocks - 1; i > 0 && start == -1; i--)
+	{
+		run = (fs->fat_t.entries_fat[i] == AVAILABLE) ? run + 1 : 0;
+		if (run == nblocks)
+		{
+			start = i;
+		}
+	}
+	if (start == -1)
+	{
+		return -1;
+	}
+
+	/* The journal is a chain that belongs to no file, other implementations leave it alone */
+	for (size_t i = 0; i < nblocks; i++)
+	{
+		fat_set(fs, start + i, (i + 1 < nblocks) ? start + i + 1 : FAT_EOC);
+	}
+	if (journal_init(fs, start, nblocks) == -1)
+	{
+		return -1;
+	}
+
+	/* No stale transaction can follow the first one */
+	memset(fs->journal.buf, 0, BLOCK_SIZE);
+	if (disk_write(fs->disk, fs->super_t.data_start_index + start, fs->journal.buf) == -1)
+	{
+		return -1;
+	}
+
+	fs->super_t.journal_valid = JOURNAL_VALID;
+	fs->super_t.journal_start = start;
+	fs->super_t.journal_blocks = nblocks;
+	fs->super_t.journal_seq = fs->journal.seq;
+	fs->meta_dirty.super = 1;
+
+	return write_metadata(fs);
+}
+/* Group commit thread, commits the metadata changes every journal interval until asked to stop */
+void *journal_thread(void *arg)
+{
+	struct fs *fs = arg;
+	struct journal *journal = &fs->journal;
+
+	pthread_mutex_lock(&journal->lock);
+	while (!journal->stop)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += journal_interval / 1000;
+		deadline.tv_nsec += (long)(journal_interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline) != ETIMEDOUT)
+		{
+			continue;
+		}
+		pthread_mutex_unlock(&journal->lock);
+
+		/* A failed commit leaves the changes pending, for the next one */
+		pthread_rwlock_rdlock(&fs->dir_lock);
+		pthread_mutex_lock(&fs->meta_lock);
+		journal_commit(fs);
+		pthread_mutex_unlock(&fs->meta_lock);
+		pthread_rwlock_unlock(&fs->dir_lock);
+
+		pthread_mutex_lock(&journal->lock);
+	}
+	pthread_mutex_unlock(&journal->lock);
+
+	return NULL;
+}
+/* Stops the group commit thread, if running */
+void journal_stop(struct fs *fs)
+{
+	struct journal *journal = &fs->journal;
+
+	if (!journal->running)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&journal->lock);
+	journal->stop = 1;
+	pthread_cond_signal(&journal->wake);
+	pthread_mutex_unlock(&journal->lock);
+	pthread_join(journal->thread, NULL);
+	journal->running = 0;
+}
+
+/* Helper of fs_sync(), with the directory and the metadata locked: commits to the journal if there is one, writes home otherwise */
+int sync_metadata(struct fs *fs)
+{
+	if (fs->journal.blocks)
+	{
+		return journal_commit(fs);
+	}
+
+	return write_metadata(fs);
+}
+
+/* Releases an instance, mounted or not, and closes its virtual disk */
+int fs_free(struct fs *fs)
+{
+	/* The group commit thread takes the directory and metadata locks, stop it before they go */
+	journal_stop(fs);
+
+	if (fs->fat_t.entries_fat != disk_map(fs->disk, 1))
+	{
+		free(fs->fat_t.entries_fat);
+	}
+	freemap_destroy(&fs->free_map);
+	freemap_destroy(&fs->dir_index.free_entries);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		map_reset(fs, i);
+		pthread_rwlock_destroy(&fs->file_locks[i]);
+		pthread_mutex_destroy(&fs->map_locks[i]);
+	}
+	for (size_t i = 0; i < fs->file_des_table.max_open_file; i++)
+	{
+		pthread_mutex_destroy(&fs->file_des_table.file_t[i].lock);
+	}
+	free(fs->file_des_table.file_t);
+	freemap_destroy(&fs->file_des_table.free_fds);
+	pthread_rwlock_destroy(&fs->dir_lock);
+	pthread_mutex_destroy(&fs->meta_lock);
+	pthread_mutex_destroy(&fs->fd_lock);
+	free(fs->journal.buf);
+	freemap_destroy(&fs->journal.fat_dirty);
+	freemap_destroy(&fs->journal.pending_free);
+	pthread_mutex_destroy(&fs->journal.lock);
+	pthread_cond_destroy(&fs->journal.wake);
+
+	int ret = 0;
+	if (fs->disk != NULL)
+	{
+		ret = disk_close(fs->disk);
+	}
+	free(fs);
+
+	return ret;
+}
+
+/* Helper of fs_mount(): opens the virtual disk and loads the file system it holds */
+struct fs *mount_load(const char *diskname)
+{
+	/* TODO: Phase 1 */
+	struct fs *fs = calloc(1, sizeof(struct fs));
+	if (fs == NULL)
+	{
+		return NULL;
+	}
+	pthread_rwlock_init(&fs->dir_lock, NULL);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		pthread_rwlock_init(&fs->file_locks[i], NULL);
+		pthread_mutex_init(&fs->map_locks[i], NULL);
+	}
+	pthread_mutex_init(&fs->meta_lock, NULL);
+	pthread_mutex_init(&fs->fd_lock, NULL);
+	pthread_mutex_init(&fs->journal.lock, NULL);
+	pthread_cond_init(&fs->journal.wake, NULL);
+
+	fs->disk = disk_open(diskname, disk_backend);
+	if (fs->disk == NULL)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+	disk_sched_config(fs->disk, sched_deadline);
+	if (trace_file && disk_trace_start(fs->disk, trace_file))
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	/* Read the first block of the disk into the superblock */
+	if (disk_read(fs->disk, 0, &fs->super_t) == -1)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	/* Error Checking */
+	if (memcmp("ECS150FS", fs->super_t.signature, sizeof(fs->super_t.signature)))
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	if (disk_count(fs->disk) != fs->super_t.total_num_blocks)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	if (fs->super_t.num_data_blocks + fs->super_t.num_FAT_blocks + 2 != fs->super_t.total_num_blocks)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+	
+	/* Each data block takes 2bytes of entries in FAT */
+	uint16_t extra = 0;
+	if (((fs->super_t.num_data_blocks * 2) % BLOCK_SIZE) != 0)
+	{
+		extra = 1;
+	}
+
+	if (fs->super_t.num_FAT_blocks != (((fs->super_t.num_data_blocks * 2) / BLOCK_SIZE) + extra))
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	if (fs->super_t.num_FAT_blocks + 1 != fs->super_t.root_dir_index)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	if (fs->super_t.num_FAT_blocks + 2 != fs->super_t.data_start_index)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	if (fs->super_t.root_dir_index + 1 != fs->super_t.data_start_index)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+
+	/* Read FAT entries, Big array of 16bit entries (linked list of data blocks) */
+	/* When the disk is mapped, the FAT blocks are used in place, unless journaled: changes must only reach them once committed */
+	int journaled = (fs->super_t.journal_valid == JOURNAL_VALID || journal_size > 0);
+	fs->fat_t.entries_fat = journaled ? NULL : disk_map(fs->disk, 1);
+	if (fs->fat_t.entries_fat == NULL)
+	{
+		fs->fat_t.entries_fat = malloc(fs->super_t.num_FAT_blocks * BLOCK_SIZE);
+		/* Read all the FAT blocks of 4096 at once, they follow the superblock */
+		struct iovec fat_iov = {.iov_base = fs->fat_t.entries_fat, .iov_len = fs->super_t.num_FAT_blocks * BLOCK_SIZE};
+		if (disk_readv(fs->disk, 1, &fat_iov, 1) == -1)
+		{
+			fs_free(fs);
+			return NULL;
+		}
+	}
+
+	/* Error Checking */
+	if (fs->fat_t.entries_fat[0] != FAT_EOC)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	/* Read root directory entries */
+	if (disk_read(fs->disk, fs->super_t.root_dir_index, &fs->root_t) == -1)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	/* Everything on disk is up to date */
+	memset(&fs->meta_dirty, 0, sizeof(fs->meta_dirty));
+
+	/* Bring the metadata up to the last commit, the replayed blocks are written home at the end */
+	int replayed = 0;
+	if (fs->super_t.journal_valid == JOURNAL_VALID)
+	{
+		if (journal_init(fs, fs->super_t.journal_start, fs->super_t.journal_blocks) == -1)
+		{
+			fs_free(fs);
+			return NULL;
+		}
+		replayed = journal_replay(fs);
+		if (replayed == -1)
+		{
+			fs_free(fs);
+			return NULL;
+		}
+		if (replayed > 0)
+		{
+			/* Recount the free space below */
+			fs->super_t.counters_valid = 0;
+		}
+	}
+
+	/* Error Checking */
+	size_t root_check = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (fs->root_t.entries_root[i].filename[0] == '\0')
+		{
+			root_check = 1;
+		}
+
+		if (root_check && fs->root_t.entries_root[i].file_size != 0)
+		{
+			fs_free(fs);
+			return NULL;
+		}
+		root_check = 0;
+	}
+
+	/* Index the files by name and keep track of the empty entries */
+	if (freemap_init(&fs->dir_index.free_entries, FS_FILE_MAX_COUNT) == -1)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+	for (int i = 0; i < DIR_HASH_SIZE; i++)
+	{
+		fs->dir_index.buckets[i] = DIR_HASH_EMPTY;
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (fs->root_t.entries_root[i].filename[0] == '\0')
+		{
+			freemap_set(&fs->dir_index.free_entries, i, 1);
+		}
+		else
+		{
+			dir_insert(fs, i);
+		}
+	}
+
+	/*
+	 * Trust the free space counters if they were maintained by the last writer,
+	 * otherwise count once. The index of free data blocks is then only built on
+	 * the first allocation.
+	 */
+	uint32_t checksum = root_checksum(fs);
+	if (fs->super_t.counters_valid != COUNTERS_VALID || fs->super_t.root_checksum != checksum)
+	{
+		/* Index the free data blocks so that allocations do not scan the FAT */
+		if (build_free_map(fs) == -1)
+		{
+			fs_free(fs);
+			return NULL;
+		}
+		fs->super_t.free_data_blocks = fs->free_map.nfree;
+		fs->super_t.free_root_entries = fs->dir_index.free_entries.nfree;
+		fs->super_t.counters_valid = COUNTERS_VALID;
+		fs->super_t.root_checksum = checksum;
+		fs->meta_dirty.super = 1;
+	}
+
+	/* Set up the file descriptors, all closed */
+	fs->file_des_table.file_t = malloc(open_max * sizeof(struct file));
+	if (fs->file_des_table.file_t == NULL || freemap_init(&fs->file_des_table.free_fds, open_max) == -1)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+	for (size_t i = 0; i < open_max; i++)
+	{
+		fs->file_des_table.file_t[i].pos_entry = -1;
+		fs->file_des_table.file_t[i].file_offset = 0;
+		fs->file_des_table.file_t[i].scratch = NULL;
+		pthread_mutex_init(&fs->file_des_table.file_t[i].lock, NULL);
+		freemap_set(&fs->file_des_table.free_fds, i, 1);
+	}
+	fs->file_des_table.max_open_file = open_max;
+	fs->file_des_table.num_open_file = 0;
+	memset(fs->file_des_table.open_count, 0, sizeof(fs->file_des_table.open_count));
+
+	/* Data blocks go through the block cache from now on, unless the disk is mapped */
+	fs->cache = cache_create(fs->disk, disk_map(fs->disk, 0) ? 0 : cache_blocks);
+	if (fs->cache == NULL)
+	{
+		fs_free(fs);
+		return NULL;
+	}
+
+	/* Set up a journal if asked to and there is none, otherwise retire the replayed transactions */
+	int journal_ret = 0;
+	if (fs->journal.blocks == 0 && journal_size > 0)
+	{
+		journal_ret = journal_create(fs, journal_size);
+	}
+	else if (replayed > 0)
+	{
+		journal_ret = journal_checkpoint(fs);
+	}
+	if (journal_ret == -1)
+	{
+		cache_destroy(fs->cache);
+		fs_free(fs);
+		return NULL;
+	}
+
+	/*
+	 * Until the next checkpoint writes the superblock home, the counters on disk
+	 * are not trusted: if the file system is not unmounted, the next mount
+	 * recounts from the FAT it finds, replayed or not
+	 */
+	if (fs->journal.blocks)
+	{
+		struct super_block mounted = fs->super_t;
+		mounted.counters_valid = 0;
+		if (disk_write(fs->disk, 0, &mounted) == -1 || disk_sync(fs->disk) == -1)
+		{
+			cache_destroy(fs->cache);
+			fs_free(fs);
+			return NULL;
+		}
+	}
+
+	/* Metadata changes are then committed in groups in the background */
+	if (fs->journal.blocks && journal_interval > 0)
+	{
+		if (pthread_create(&fs->journal.thread, NULL, journal_thread, fs) != 0)
+		{
+			cache_destroy(fs->cache);
+			fs_free(fs);
+			return NULL;
+		}
+		fs->journal.running = 1;
+	}
+
+	return fs;
+}
+
+fs_t *fs_mount_ctx(const char *diskname)
+{
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_MOUNT);
+	struct fs *fs = mount_load(diskname);
+	stats_end(&probe, FS_OP_MOUNT, fs ? 0 : -1);
+
+	return fs;
+}
+
+int fs_mount(const char *diskname)
+{
+	/* Only one default instance, like there used to be only one disk */
+	if (default_fs != NULL)
+	{
+		return -1;
+	}
+
+	default_fs = fs_mount_ctx(diskname);
+	if (default_fs == NULL)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Helper#1 of fs_umount(): checks that no file is open and writes everything to disk, fs stays mounted if it fails */
+int umount_prepare(struct fs *fs)
+{
+	pthread_mutex_lock(&fs->fd_lock);
+	size_t num_open_file = fs->file_des_table.num_open_file;
+	pthread_mutex_unlock(&fs->fd_lock);
+	if (num_open_file != 0)
+	{
+		return -1;
+	}
+
+	/* write the modified blocks to disk, home even with a journal so that the disk does not need it */
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	pthread_mutex_lock(&fs->meta_lock);
+	int ret = fs->journal.blocks ? journal_checkpoint(fs) : write_metadata(fs);
+	pthread_mutex_unlock(&fs->meta_lock);
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	return ret;
+}
+/* Helper#2 of fs_umount(): releases a prepared instance and closes its virtual disk */
+int umount_release(struct fs *fs)
+{
+	/* release the cached data blocks, all clean by now, once nothing commits them anymore */
+	journal_stop(fs);
+	int ret = cache_destroy(fs->cache);
+
+	/* clean everything and close virtual disk */
+	if (fs_free(fs) == -1)
+	{
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* Close virtual disk - Make sure that Virtual disk is up to date */
+int fs_umount_ctx(fs_t *fs)
+{
+	/* TODO: Phase 1 */
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_UMOUNT);
+	int ret = -1;
+	if (fs != NULL && umount_prepare(fs) == 0)
+	{
+		ret = umount_release(fs);
+	}
+	stats_end(&probe, FS_OP_UMOUNT, ret);
+
+	return ret;
+}
+
+int fs_umount(void)
+{
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_UMOUNT);
+	int ret = -1;
+	if (default_fs != NULL && umount_prepare(default_fs) == 0)
+	{
+		fs_t *fs = default_fs;
+		default_fs = NULL;
+		ret = umount_release(fs);
+	}
+	stats_end(&probe, FS_OP_UMOUNT, ret);
+
+	return ret;
+}
+
+/* Write the modified data and metadata blocks to disk */
+int fs_sync_ctx(fs_t *fs)
+{
+	/* Error Checking: No underlying virtual disk was opened */
+	if (fs == NULL)
+	{
+		return -1;
+	}
+
+	/* Keep the metadata from changing while it is written, file sizes and first blocks only change with the metadata locked */
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	pthread_mutex_lock(&fs->meta_lock);
+
+	int ret = sync_metadata(fs);
+
+	pthread_mutex_unlock(&fs->meta_lock);
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	return ret;
+}
+
+int fs_sync(void)
+{
+	return fs_sync_ctx(default_fs);
+}
+
+/* Show information about volume */
+int fs_info_ctx(fs_t *fs)
+{
+	/* TODO: Phase 1 */
+	/* 
+		FS Info:
+		total_blk_count=8198
+		fat_blk_count=4
+		rdir_blk=5
+		data_blk=6
+		data_blk_count=8192
+		fat_free_ratio=8191/8192
+		rdir_free_ratio=128/128
+	*/
+
+	/* Error Checking: No underlying virtual disk was opened */
+	if (fs == NULL)
+	{
+		return -1;
+	}
+
+	/* Numbers of free FAT, Root directory entries are kept up to date */
+	pthread_mutex_lock(&fs->meta_lock);
+	int fat_free = fs->super_t.free_data_blocks;
+	int rdir_free = fs->super_t.free_root_entries;
+	pthread_mutex_unlock(&fs->meta_lock);
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%d\n", fs->super_t.total_num_blocks);
+	printf("fat_blk_count=%d\n", fs->super_t.num_FAT_blocks);
+	printf("rdir_blk=%d\n", fs->super_t.root_dir_index);
+	printf("data_blk=%d\n", fs->super_t.data_start_index);
+	printf("data_blk_count=%d\n", fs->super_t.num_data_blocks);
+	printf("fat_free_ratio=%d/%d\n", fat_free, fs->super_t.num_data_blocks);
+	printf("rdir_free_ratio=%d/%d\n", rdir_free, FS_FILE_MAX_COUNT);
+
+	return 0;
+}
+
+int fs_info(void)
+{
+	return fs_info_ctx(default_fs);
+}
+
+/* Helper of fs_create(), with the directory locked */
+int file_create(struct fs *fs, const char *filename)
+{
+	if (!filename)
+	{
+		return -1;
+	}
+
+	if (strlen(filename) >= FS_FILENAME_LEN || filename[0] == '\0')
+	{
+		return -1;
+	}
+
+	/* Duplicate filename */
+	if (dir_lookup(fs, filename) != -1)
+	{
+		return -1;
+	}
+
+	/* Root directory already contains MAX files */
+	int i = freemap_first(&fs->dir_index.free_entries, 0);
+	if (i == -1)
+	{
+		return -1;
+	}
+
+	/* Create a new empty file with default properties, entries only change with the metadata locked so that it can be committed at any time */
+	pthread_mutex_lock(&fs->meta_lock);
+	memset(fs->root_t.entries_root[i].filename, 0, FS_FILENAME_LEN);
+	strcpy((char *)fs->root_t.entries_root[i].filename, filename);
+	fs->root_t.entries_root[i].file_size = 0;
+	fs->root_t.entries_root[i].first_data_index = FAT_EOC;
+	dir_insert(fs, i);
+	fs->super_t.free_root_entries--;
+	fs->meta_dirty.root = 1;
+	pthread_mutex_unlock(&fs->meta_lock);
+
+	return 0;
+}
+
+int fs_create_ctx(fs_t *fs, const char *filename)
+{
+	/* TODO: Phase 2 */
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_CREATE);
+	int ret = -1;
+	if (fs != NULL)
+	{
+		pthread_rwlock_wrlock(&fs->dir_lock);
+		ret = file_create(fs, filename);
+		pthread_rwlock_unlock(&fs->dir_lock);
+	}
+	stats_end(&probe, FS_OP_CREATE, ret);
+
+	return ret;
+}
+
+int fs_create(const char *filename)
+{
+	return fs_create_ctx(default_fs, filename);
+}
+
+/* Helper of fs_delete(), with the directory locked */
+int file_delete(struct fs *fs, const char *filename)
+{
+	if (!filename)
+	{
+		return -1;
+	}
+
+	if (strlen(filename) > FS_FILENAME_LEN)
+	{
+		return -1;
+	}
+
+	/* if there is no filename to delete */
+	int pos = dir_lookup(fs, filename);
+	if (pos == -1)
+	{
+		return -1;
+	}
+
+	/* if the file is currently open, files are only opened with the directory locked */
+	pthread_mutex_lock(&fs->fd_lock);
+	int open_count = fs->file_des_table.open_count[pos];
+	pthread_mutex_unlock(&fs->fd_lock);
+	if (open_count != 0)
+	{
+		return -1;
+	}
+
+	/* Delethe filename from the root dir, once positional transfers through descriptors closed meanwhile are over */
+	pthread_rwlock_wrlock(&fs->file_locks[pos]);
+	pthread_mutex_lock(&fs->meta_lock);
+	uint16_t data_index = fs->root_t.entries_root[pos].first_data_index;
+	while (data_index != FAT_EOC)
+	{
+		uint16_t next_index = fs->fat_t.entries_fat[data_index];
+		fat_set(fs, data_index, AVAILABLE);
+		data_index = next_index;
+	}
+	fs->super_t.free_root_entries++;
+	fs->meta_dirty.root = 1;
+	dir_remove(fs, pos);
+	struct entry empty_entry = {.filename = "", .file_size = 0, .first_data_index = FAT_EOC};
+	fs->root_t.entries_root[pos] = empty_entry;
+	pthread_mutex_unlock(&fs->meta_lock);
+	map_reset(fs, pos);
+	pthread_rwlock_unlock(&fs->file_locks[pos]);
+
+	return 0;
+}
+
+int fs_delete_ctx(fs_t *fs, const char *filename)
+{
+	/* TODO: Phase 2 */
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_DELETE);
+	int ret = -1;
+	if (fs != NULL)
+	{
+		pthread_rwlock_wrlock(&fs->dir_lock);
+		ret = file_delete(fs, filename);
+		pthread_rwlock_unlock(&fs->dir_lock);
+	}
+	stats_end(&probe, FS_OP_DELETE, ret);
+	
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	return fs_delete_ctx(default_fs, filename);
+}
+
+int fs_ls_ctx(fs_t *fs)
+{
+	/* TODO: Phase 2 */
+	if (fs == NULL)
+	{
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	printf("FS Ls:\n");
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (strcmp((char*) fs->root_t.entries_root[i].filename, "") != 0)
+		{
+			pthread_rwlock_rdlock(&fs->file_locks[i]);
+			printf("file: %s, size: %d, data_blk: %d\n", fs->root_t.entries_root[i].filename, fs->root_t.entries_root[i].file_size, fs->root_t.entries_root[i].first_data_index);
+			pthread_rwlock_unlock(&fs->file_locks[i]);
+		}
+	}
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	return 0;
+}
+
+int fs_ls(void)
+{
+	return fs_ls_ctx(default_fs);
+}
+
+/* Helper of fs_open() */
+int file_open(struct fs *fs, const char *filename)
+{
+	/* TODO: Phase 3 */
+	if (fs == NULL || !filename)
+	{
+		return -1;
+	}
+
+	if (strlen(filename) > FS_FILENAME_LEN)
+	{
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+
+	/* no filename to open */
+	int pos = dir_lookup(fs, filename);
+	if (pos == -1)
+	{
+		pthread_rwlock_unlock(&fs->dir_lock);
+		return -1;
+	}
+
+	/* find free index of file descriptor table which is file descriptor */
+	pthread_mutex_lock(&fs->fd_lock);
+	int fd_id = freemap_first(&fs->file_des_table.free_fds, 0);
+	if (fd_id == -1)
+	{
+		pthread_mutex_unlock(&fs->fd_lock);
+		pthread_rwlock_unlock(&fs->dir_lock);
+		return -1;
+	}
+
+	freemap_set(&fs->file_des_table.free_fds, fd_id, 0);
+	fs->file_des_table.open_count[pos]++;
+	fs->file_des_table.num_open_file++;
+	pthread_mutex_unlock(&fs->fd_lock);
+
+	struct file *file = &fs->file_des_table.file_t[fd_id];
+	pthread_mutex_lock(&file->lock);
+	file->pos_entry = pos;
+	file->file_offset = 0;
+	file->ra_next = 0;
+	file->ra_window = 0;
+	file->ra_end = 0;
+	pthread_mutex_unlock(&file->lock);
+
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	return fd_id;
+}
+
+int fs_open_ctx(fs_t *fs, const char *filename)
+{
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_OPEN);
+	int ret = file_open(fs, filename);
+	stats_end(&probe, FS_OP_OPEN, ret);
+
+	return ret;
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_ctx(default_fs, filename);
+}
+
+int fs_close_ctx(fs_t *fs, int fd)
+{
+	/* TODO: Phase 3 */
+	struct file *file = lock_file(fs, fd);
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->fd_lock);
+	fs->file_des_table.open_count[file->pos_entry]--;
+	freemap_set(&fs->file_des_table.free_fds, fd, 1);
+	fs->file_des_table.num_open_file--;
+	pthread_mutex_unlock(&fs->fd_lock);
+
+	file->pos_entry = -1;
+	file->file_offset = 0;
+	free(file->scratch);
+	file->scratch = NULL;
+	pthread_mutex_unlock(&file->lock);
+
+	return 0;
+}
+
+int fs_close(int fd)
+{
+	return fs_close_ctx(default_fs, fd);
+}
+
+int fs_stat_ctx(fs_t *fs, int fd)
+{
+	/* TODO: Phase 3 */
+	struct file *file = lock_file(fs, fd);
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->file_locks[file->pos_entry]);
+	int file_size = fs->root_t.entries_root[file->pos_entry].file_size;
+	pthread_rwlock_unlock(&fs->file_locks[file->pos_entry]);
+	pthread_mutex_unlock(&file->lock);
+
+	return file_size;
+}
+
+int fs_stat(int fd)
+{
+	return fs_stat_ctx(default_fs, fd);
+}
+
+/* Helper of fs_lseek() */
+int file_lseek(struct fs *fs, int fd, size_t offset)
+{
+	/* TODO: Phase 3 */
+	struct file *file = lock_file(fs, fd);
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->file_locks[file->pos_entry]);
+	size_t current_file_size = fs->root_t.entries_root[file->pos_entry].file_size;
+	pthread_rwlock_unlock(&fs->file_locks[file->pos_entry]);
+	if (offset > current_file_size)
+	{
+		pthread_mutex_unlock(&file->lock);
+		return -1;
+	}
+
+	file->file_offset = offset;
+	pthread_mutex_unlock(&file->lock);
+
+	return 0;
+}
+
+int fs_lseek_ctx(fs_t *fs, int fd, size_t offset)
+{
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_LSEEK);
+	int ret = file_lseek(fs, fd, offset);
+	stats_end(&probe, FS_OP_LSEEK, ret);
+
+	return ret;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	return fs_lseek_ctx(default_fs, fd, offset);
+}
+
+/* Helper#1: Returns the index of the data block holding the file's offset, FAT_EOC past the end of the chain */
+uint16_t data_index(struct fs *fs, int pos_entry, size_t offset)
+{
+	struct block_map *map = &fs->block_maps[pos_entry];
+	size_t nth = offset / BLOCK_SIZE;
+	uint16_t index = FAT_EOC;
+
+	pthread_mutex_lock(&fs->map_locks[pos_entry]);
+
+	/* Extend the map from where it stopped, each FAT entry is followed once */
+	while (map->count <= nth)
+	{
+		uint16_t next;
+		if (map->count == 0)
+		{
+			next = fs->root_t.entries_root[pos_entry].first_data_index;
+		}
+		else
+		{
+			next = fs->fat_t.entries_fat[map->blocks[map->count - 1]];
+		}
+
+		if (next == FAT_EOC || next >= fs->super_t.num_data_blocks || map->count >= fs->super_t.num_data_blocks)
+		{
+			break;
+		}
+
+		if (map_append(map, next) == -1)
+		{
+			break;
+		}
+	}
 
-struct super_block super_t;
-struct root_directory root_t;
-struct FAT fat_t;
-struct file_descriptor_table file_des_table;
+	if (map->count > nth)
+	{
+		index = map->blocks[nth];
+	}
+	pthread_mutex_unlock(&fs->map_locks[pos_entry]);
 
-/* Open the virtual disk, read the metadata  */
-int fs_mount(const char *diskname)
+	return index;
+}
+/* Helper#2: Reads the data blocks holding [offset, offset + count) of a file in one batch */
+void prefetch_blocks(struct fs *fs, int pos_entry, size_t offset, size_t count)
 {
-	/* TODO: Phase 1 */
-	if (block_disk_open(diskname) == -1)
+	size_t blocks[BLOCK_QUEUE_DEPTH];
+	size_t n = 0;
+
+	for (size_t off = offset - offset % BLOCK_SIZE; off < offset + count && n < BLOCK_QUEUE_DEPTH; off += BLOCK_SIZE)
 	{
-		return -1;
+		uint16_t index = data_index(fs, pos_entry, off);
+		if (index == FAT_EOC)
+		{
+			break;
+		}
+		blocks[n++] = index + fs->super_t.data_start_index;
 	}
 
-	/* Read the first block of the disk into the superblock */
-	if (block_read(0, &super_t) == -1)
+	/* Only a hint, blocks that cannot be prefetched are read later on */
+	if (n > 1)
 	{
-		return -1;
+		cache_prefetch(fs->cache, blocks, n);
 	}
+}
 
-	/* Error Checking */
-	if (memcmp("ECS150FS", super_t.signature, sizeof(super_t.signature)))
+/* Helper#3: Reads the data blocks following offset in the background, as far as the descriptor's readahead window */
+void readahead_blocks(struct fs *fs, struct file *file, size_t offset)
+{
+	size_t blocks[CACHE_READAHEAD_BLOCKS];
+	size_t n = 0;
+	size_t f_size = fs->root_t.entries_root[file->pos_entry].file_size;
+
+	/* Start at the next block, skipping what was already read ahead */
+	size_t off = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	size_t end = off + file->ra_window * BLOCK_SIZE;
+	if (off < file->ra_end)
 	{
-		return -1;
+		off = file->ra_end;
 	}
 
-	if (block_disk_count() != super_t.total_num_blocks)
+	for (; off < end && off < f_size; off += BLOCK_SIZE)
 	{
-		return -1;
+		uint16_t index = data_index(fs, file->pos_entry, off);
+		if (index == FAT_EOC)
+		{
+			break;
+		}
+		blocks[n++] = index + fs->super_t.data_start_index;
 	}
 
-	if (super_t.num_data_blocks + super_t.num_FAT_blocks + 2 != super_t.total_num_blocks)
+	if (n > 0)
 	{
+		cache_readahead(fs->cache, blocks, n);
+		file->ra_end = off;
+	}
+}
+
+/* Commits the journal when the only free blocks left are waiting for it, with the metadata locked. Returns whether there are free blocks again */
+int reclaim_pending(struct fs *fs) {
+	if (!fs->journal.blocks || fs->journal.pending_free.nfree == 0) {
+		return 0;
+	}
+	return journal_commit(fs) == 0 && fs->free_map.nfree != 0;
+}
+/* finds first empty entry in FAT, with the metadata locked */
+int first_fit(struct fs *fs) {
+	if (!fs->free_map.bits && build_free_map(fs) == -1) {
 		return -1;
 	}
-	
-	/* Each data block takes 2bytes of entries in FAT */
-	uint16_t extra = 0;
-	if (((super_t.num_data_blocks * 2) % BLOCK_SIZE) != 0)
-	{
-		extra = 1;
+	long index = freemap_first(&fs->free_map, 1);
+	if (index == -1 && reclaim_pending(fs)) {
+		index = freemap_first(&fs->free_map, 1);
+	}
+	return index;
+}
+/* Picks a free data block to follow prev in a chain that still needs count blocks, -1 if the disk is full. Metadata must be locked */
+long alloc_block(struct fs *fs, uint16_t prev, size_t count) {
+	if (!fs->free_map.bits && build_free_map(fs) == -1) {
+		return -1;
 	}
+	/* Keep the chain contiguous when possible, otherwise move to a run that fits the rest of it */
+	if (prev != FAT_EOC && freemap_first(&fs->free_map, prev + 1) == prev + 1) {
+		return prev + 1;
+	}
+	long run = freemap_first_run(&fs->free_map, 1, count);
+	if (run != -1) {
+		return run;
+	}
+	long index = freemap_first(&fs->free_map, 1);
+	if (index == -1 && reclaim_pending(fs)) {
+		index = freemap_first(&fs->free_map, 1);
+	}
+	return index;
+}
+/* Links a free data block at the end of a file, the block map must cover the whole chain. Metadata must be locked */
+void chain_append(struct fs *fs, int pos_entry, uint16_t index) {
+	struct block_map *map = &fs->block_maps[pos_entry];
+	pthread_mutex_lock(&fs->map_locks[pos_entry]);
+	fat_set(fs, index, FAT_EOC);
+	if (map->count == 0) {
+		fs->root_t.entries_root[pos_entry].first_data_index = index;
+		fs->meta_dirty.root = 1;
+	} else {
+		fat_set(fs, map->blocks[map->count - 1], index);
+	}
+	map_append(map, index);
+	pthread_mutex_unlock(&fs->map_locks[pos_entry]);
+}
+/* Position in the buffers of a scatter/gather transfer */
+struct iov_cursor
+{
+	const struct iovec *iov;
+	int iovcnt;
+	/* Current buffer and offset within it */
+	int i;
+	size_t off;
+};
 
-	if (super_t.num_FAT_blocks != (((super_t.num_data_blocks * 2) / BLOCK_SIZE) + extra))
+/* Total size of the buffers of a transfer, -1 if there is none or if one is invalid */
+long iov_total(const struct iovec *iov, int iovcnt)
+{
+	if (iov == NULL || iovcnt <= 0)
 	{
 		return -1;
 	}
 
-	if (super_t.num_FAT_blocks + 1 != super_t.root_dir_index)
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
 	{
-		return -1;
+		if (iov[i].iov_len != 0 && iov[i].iov_base == NULL)
+		{
+			return -1;
+		}
+		total += iov[i].iov_len;
+		if (total > INT_MAX)
+		{
+			return -1;
+		}
 	}
 
-	if (super_t.num_FAT_blocks + 2 != super_t.data_start_index)
+	/* Nothing to transfer, like a count of 0 */
+	if (total == 0)
 	{
 		return -1;
 	}
 
-	if (super_t.root_dir_index + 1 != super_t.data_start_index)
+	return total;
+}
+/* Gets the next len bytes of the buffers in place and moves past them, NULL if they span several buffers */
+uint8_t *iov_direct(struct iov_cursor *cur, size_t len)
+{
+	while (cur->i < cur->iovcnt && cur->off == cur->iov[cur->i].iov_len)
 	{
-		return -1;
+		cur->i++;
+		cur->off = 0;
+	}
+	if (cur->i == cur->iovcnt || cur->iov[cur->i].iov_len - cur->off < len)
+	{
+		return NULL;
 	}
 
+	uint8_t *bytes = (uint8_t *)cur->iov[cur->i].iov_base + cur->off;
+	cur->off += len;
 
-	/* Read FAT entries, Big array of 16bit entries (linked list of data blocks) */
-	fat_t.entries_fat = malloc(super_t.num_FAT_blocks * BLOCK_SIZE);
-	/* Read block into each FAT block of 4096 */
-	for (size_t i = 1; i <= super_t.num_FAT_blocks; i++)
+	return bytes;
+}
+/* Copies the next len bytes of the buffers to block (gather), or block to them (scatter), and moves past them */
+void iov_copy(struct iov_cursor *cur, uint8_t *block, size_t len, int scatter)
+{
+	while (len > 0)
 	{
-		if (block_read(i, (void *) fat_t.entries_fat + (i - 1) * BLOCK_SIZE) == -1)
+		size_t n = cur->iov[cur->i].iov_len - cur->off;
+		if (n > len)
 		{
-			return -1;
+			n = len;
+		}
+
+		uint8_t *bytes = (uint8_t *)cur->iov[cur->i].iov_base + cur->off;
+		if (scatter)
+		{
+			memcpy(bytes, block, n);
+		}
+		else
+		{
+			memcpy(block, bytes, n);
+		}
+		block += n;
+		len -= n;
+		cur->off += n;
+		if (cur->off == cur->iov[cur->i].iov_len)
+		{
+			cur->i++;
+			cur->off = 0;
+		}
+	}
+}
+
+/*
+ * Writes count bytes from the buffers at offset of a file, at most up to its
+ * current size, with the file locked. Each block is written once however the
+ * buffers split it, partial blocks go through scratch
+ */
+int write_at(struct fs *fs, int pos_entry, uint8_t *scratch, const struct iovec *iov, int iovcnt, size_t count, size_t offset) {
+	struct entry *f_entry = &fs->root_t.entries_root[pos_entry];
+	size_t f_size = f_entry->file_size;
+	size_t f_offset = offset;
+	struct iov_cursor cur = {.iov = iov, .iovcnt = iovcnt};
+
+	size_t bytes_wrote = 0;
+	while (bytes_wrote < count)
+	{
+		size_t block_offset = f_offset % BLOCK_SIZE;
+		size_t diff = BLOCK_SIZE - block_offset;
+		if (diff > count - bytes_wrote)
+		{
+			diff = count - bytes_wrote;
+		}
+
+		uint16_t index = data_index(fs, pos_entry, f_offset);
+		int fresh = 0;
+		if (index == FAT_EOC) //expand blocks
+		{
+			pthread_mutex_lock(&fs->meta_lock);
+			int free_index = first_fit(fs);
+			if (free_index != -1)
+			{
+				chain_append(fs, pos_entry, free_index);
+			}
+			pthread_mutex_unlock(&fs->meta_lock);
+			if (free_index == -1) //no more free data blocks
+			{
+				break;
+			}
+			index = free_index;
+			fresh = 1;
+		}
+
+		/* Whole blocks go straight from the caller's buffer when a single buffer holds them */
+		uint8_t *direct = (diff == BLOCK_SIZE) ? iov_direct(&cur, diff) : NULL;
+		if (direct != NULL)
+		{
+			if (cache_write(fs->cache, index + fs->super_t.data_start_index, direct) == -1)
+			{
+				break;
+			}
+		}
+		else
+		{
+			/* Partial blocks are read first, then modified, whole blocks gathered from several buffers are just overwritten */
+			if (scratch == NULL)
+			{
+				break;
+			}
+			if (diff < BLOCK_SIZE && fresh)
+			{
+				memset(scratch, 0, BLOCK_SIZE);
+			}
+			else if (diff < BLOCK_SIZE && cache_read(fs->cache, index + fs->super_t.data_start_index, scratch) == -1)
+			{
+				break;
+			}
+			iov_copy(&cur, scratch + block_offset, diff, 0);
+
+			if (cache_write(fs->cache, index + fs->super_t.data_start_index, scratch) == -1)
+			{
+				break;
+			}
+		}
+
+		bytes_wrote += diff;
+		f_offset += diff; //changing the offset as we go
+		if (f_offset > f_size)
+		{
+			f_size = f_offset;
 		}
 	}
 
+	if (f_entry->file_size != f_size)
+	{
+		pthread_mutex_lock(&fs->meta_lock);
+		f_entry->file_size = f_size;
+		fs->meta_dirty.root = 1;
+		pthread_mutex_unlock(&fs->meta_lock);
+	}
+
+	return bytes_wrote;
+}
+/* Writes the buffers to an open file, with the descriptor and the file locked */
+int file_write(struct fs *fs, struct file *file, const struct iovec *iov, int iovcnt) {
 	/* Error Checking */
-	if (fat_t.entries_fat[0] != FAT_EOC)
+	long count = iov_total(iov, iovcnt);
+	if (count == -1)
 	{
 		return -1;
 	}
 
-	/* Read root directory entries */
-	if (block_read(super_t.root_dir_index, &root_t) == -1)
+	/* The file may have been truncated through another descriptor */
+	size_t f_size = fs->root_t.entries_root[file->pos_entry].file_size;
+	if (file->file_offset > f_size)
 	{
-		return -1;
+		file->file_offset = f_size;
 	}
 
-	/* Error Checking */
-	size_t root_check = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	int bytes_wrote = write_at(fs, file->pos_entry, get_scratch(file), iov, iovcnt, count, file->file_offset);
+	file->file_offset += bytes_wrote;
+
+	return bytes_wrote;
+}
+
+/* Write to a file from several buffers */
+int fs_writev_ctx(fs_t *fs, int fd, const struct iovec *iov, int iovcnt) {
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_WRITE);
+	int ret = -1;
+	struct file *file = lock_file(fs, fd);
+	if (file != NULL)
+	{
+		pthread_rwlock_wrlock(&fs->file_locks[file->pos_entry]);
+		ret = file_write(fs, file, iov, iovcnt);
+		pthread_rwlock_unlock(&fs->file_locks[file->pos_entry]);
+		pthread_mutex_unlock(&file->lock);
+	}
+	stats_end(&probe, FS_OP_WRITE, ret);
+
+	return ret;
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_writev_ctx(default_fs, fd, iov, iovcnt);
+}
+
+/* Write to a file */
+int fs_write_ctx(fs_t *fs, int fd, void *buf, size_t count)
+{
+	struct iovec iov = {.iov_base = buf, .iov_len = count};
+
+	return fs_writev_ctx(fs, fd, &iov, 1);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	return fs_write_ctx(default_fs, fd, buf, count);
+}
+
+/*
+ * Reads count bytes at offset of a file into the buffers, which must lie
+ * within the file, with the file locked for reading. Each block is read once
+ * however the buffers split it, partial blocks go through scratch
+ */
+int read_at(struct fs *fs, int pos_entry, uint8_t *scratch, const struct iovec *iov, int iovcnt, size_t count, size_t offset)
+{
+	size_t f_offset = offset;
+	struct iov_cursor cur = {.iov = iov, .iovcnt = iovcnt};
+
+	/* Queue all the blocks to read at once rather than one at a time */
+	prefetch_blocks(fs, pos_entry, f_offset, count);
+
+	size_t bytes_read = 0;
+	while (bytes_read < count)
 	{
-		if (root_t.entries_root[i].filename[0] == '\0')
+		size_t block_offset = f_offset % BLOCK_SIZE;
+		size_t diff = BLOCK_SIZE - block_offset;
+		if (diff > count - bytes_read)
 		{
-			root_check = 1;
+			diff = count - bytes_read;
 		}
 
-		if (root_check && root_t.entries_root[i].file_size != 0)
+		/* Index of the data block corresponding to the file offset */
+		uint16_t index = data_index(fs, pos_entry, f_offset);
+		if (index == FAT_EOC)
 		{
-			return -1;
+			break;
 		}
-		root_check = 0;
+
+		/* Whole blocks go straight to the caller's buffer when a single buffer holds them */
+		uint8_t *direct = (diff == BLOCK_SIZE) ? iov_direct(&cur, diff) : NULL;
+		if (direct != NULL)
+		{
+			if (cache_read(fs->cache, index + fs->super_t.data_start_index, direct) == -1)
+			{
+				break;
+			}
+		}
+		else
+		{
+			if (scratch == NULL || cache_read(fs->cache, index + fs->super_t.data_start_index, scratch) == -1)
+			{
+				break;
+			}
+			iov_copy(&cur, scratch + block_offset, diff, 1);
+		}
+
+		bytes_read += diff;
+		f_offset += diff;
 	}
 
-	return 0;
+	return bytes_read;
 }
-
-/* Close virtual disk - Make sure that Virtual disk is up to date */
-int fs_umount(void)
+/* Reads from an open file into the buffers, with the descriptor locked and the file locked for reading */
+int file_read(struct fs *fs, struct file *file, const struct iovec *iov, int iovcnt)
 {
-	/* TODO: Phase 1 */
-	/* write blocks to disk */
-	if (block_write(0, &super_t) == -1)
+	/* TODO: Phase 4 */
+	long total = iov_total(iov, iovcnt);
+	if (total == -1)
 	{
 		return -1;
 	}
+	size_t count = total;
+	
+	/* Find correponding properties first */
+	size_t f_offset = file->file_offset;
+	size_t f_size = fs->root_t.entries_root[file->pos_entry].file_size;
+
+	/* Do not read past the end of the file */
+	if (f_offset >= f_size)
+	{
+		return 0;
+	}
+	if (count > f_size - f_offset)
+	{
+		count = f_size - f_offset;
+	}
 
-	for (int i = 1; i < super_t.root_dir_index; i++)
+	/* Sequential reads grow the readahead window, seeks shrink it */
+	if (f_offset == file->ra_next)
 	{
-		if (block_write(i, fat_t.entries_fat + (i - 1) * BLOCK_SIZE) == -1) 
+		file->ra_window = file->ra_window ? file->ra_window * 2 : READAHEAD_MIN;
+		if (file->ra_window > CACHE_READAHEAD_BLOCKS)
 		{
-			return -1;
+			file->ra_window = CACHE_READAHEAD_BLOCKS;
 		}
 	}
+	else
+	{
+		file->ra_window /= 2;
+		file->ra_end = 0;
+	}
+
+	int bytes_read = read_at(fs, file->pos_entry, get_scratch(file), iov, iovcnt, count, f_offset);
+	f_offset += bytes_read;
+	file->file_offset = f_offset;
+
+	/* Get the next blocks ready while the caller consumes these ones */
+	file->ra_next = f_offset;
+	readahead_blocks(fs, file, f_offset);
+
+	return bytes_read;
+}
+
+/* Read from a file into several buffers */
+int fs_readv_ctx(fs_t *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_READ);
+	int ret = -1;
+	struct file *file = lock_file(fs, fd);
+	if (file != NULL)
+	{
+		pthread_rwlock_rdlock(&fs->file_locks[file->pos_entry]);
+		ret = file_read(fs, file, iov, iovcnt);
+		pthread_rwlock_unlock(&fs->file_locks[file->pos_entry]);
+		pthread_mutex_unlock(&file->lock);
+	}
+	stats_end(&probe, FS_OP_READ, ret);
+
+	return ret;
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_readv_ctx(default_fs, fd, iov, iovcnt);
+}
+
+/* Read from a file */
+int fs_read_ctx(fs_t *fs, int fd, void *buf, size_t count)
+{
+	struct iovec iov = {.iov_base = buf, .iov_len = count};
+
+	return fs_readv_ctx(fs, fd, &iov, 1);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	return fs_read_ctx(default_fs, fd, buf, count);
+}
 
-	if (block_write(super_t.root_dir_index, &root_t) == -1)
+/*
+ * Locks the file an open descriptor refers to, and only holds the descriptor
+ * while doing so: positional transfers do not use its offset, and the file
+ * cannot be deleted while locked. Returns the position of the file in the root
+ * directory, -1 if fd is invalid or not open.
+ */
+int lock_file_at(struct fs *fs, int fd, int exclusive)
+{
+	struct file *file = lock_file(fs, fd);
+	if (file == NULL)
 	{
 		return -1;
 	}
 
-	/* clean and reset everything */ 
-	free(fat_t.entries_fat);
-	struct entry empty_entry = {.filename = "", .file_size = 0, .first_data_index = 0};
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	int pos_entry = file->pos_entry;
+	if (exclusive)
+	{
+		pthread_rwlock_wrlock(&fs->file_locks[pos_entry]);
+	}
+	else
 	{
-		root_t.entries_root[i] = empty_entry;
+		pthread_rwlock_rdlock(&fs->file_locks[pos_entry]);
 	}
-	char *tempstr = "";
-	strcpy((char *)super_t.signature, tempstr);
-	super_t.total_num_blocks = 0;
-	super_t.root_dir_index = 0;
-	super_t.data_start_index = 0;
-	super_t.num_data_blocks = 0;
-	super_t.num_FAT_blocks = 0;
+	pthread_mutex_unlock(&file->lock);
+
+	return pos_entry;
+}
 
-	if (file_des_table.num_open_file != 0)
+/* Helper of fs_pwrite() */
+int file_pwrite(struct fs *fs, int fd, void *buf, size_t count, size_t offset)
+{
+	if (count == 0 || buf == NULL)
 	{
 		return -1;
 	}
 
-	/* close virtual disk */
-	if (block_disk_close() == -1)
+	int pos_entry = lock_file_at(fs, fd, 1);
+	if (pos_entry == -1)
 	{
 		return -1;
 	}
 
-	return 0;
+	/* No holes: writes start at most at the end of the file */
+	int ret = -1;
+	if (offset <= fs->root_t.entries_root[pos_entry].file_size)
+	{
+		uint8_t scratch[BLOCK_SIZE];
+		struct iovec iov = {.iov_base = buf, .iov_len = count};
+		ret = write_at(fs, pos_entry, scratch, &iov, 1, count, offset);
+	}
+	pthread_rwlock_unlock(&fs->file_locks[pos_entry]);
+
+	return ret;
 }
 
-/* Show information about volume */
-int fs_info(void)
+int fs_pwrite_ctx(fs_t *fs, int fd, void *buf, size_t count, size_t offset)
 {
-	/* TODO: Phase 1 */
-	/* 
-		FS Info:
-		total_blk_count=8198
-		fat_blk_count=4
-		rdir_blk=5
-		data_blk=6
-		data_blk_count=8192
-		fat_free_ratio=8191/8192
-		rdir_free_ratio=128/128
-	*/
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_WRITE);
+	int ret = file_pwrite(fs, fd, buf, count, offset);
+	stats_end(&probe, FS_OP_WRITE, ret);
 
-	/* Error Checking: No underlying virtual disk was opened */
-	if (super_t.signature[0] == '\0')
+	return ret;
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	return fs_pwrite_ctx(default_fs, fd, buf, count, offset);
+}
+
+/* Helper of fs_pread() */
+int file_pread(struct fs *fs, int fd, void *buf, size_t count, size_t offset)
+{
+	if (count == 0 || buf == NULL)
 	{
 		return -1;
 	}
 
-	/* Find numbers of free FAT, Root directory */
-	int fat_free = 0;
-	for (int i = 0; i < super_t.num_data_blocks; i++)
+	int pos_entry = lock_file_at(fs, fd, 0);
+	if (pos_entry == -1)
 	{
-		if (fat_t.entries_fat[i] == AVAILABLE)
-		{
-			fat_free++;
-		}
+		return -1;
 	}
 
-	int rdir_free = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	/* Random accesses, the readahead state of the descriptor is left alone too */
+	int ret = 0;
+	size_t f_size = fs->root_t.entries_root[pos_entry].file_size;
+	if (offset < f_size)
 	{
-		if (root_t.entries_root[i].filename[0] == AVAILABLE)
+		uint8_t scratch[BLOCK_SIZE];
+		if (count > f_size - offset)
 		{
-			rdir_free++;
+			count = f_size - offset;
 		}
+		struct iovec iov = {.iov_base = buf, .iov_len = count};
+		ret = read_at(fs, pos_entry, scratch, &iov, 1, count, offset);
 	}
+	pthread_rwlock_unlock(&fs->file_locks[pos_entry]);
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", super_t.total_num_blocks);
-	printf("fat_blk_count=%d\n", super_t.num_FAT_blocks);
-	printf("rdir_blk=%d\n", super_t.root_dir_index);
-	printf("data_blk=%d\n", super_t.data_start_index);
-	printf("data_blk_count=%d\n", super_t.num_data_blocks);
-	printf("fat_free_ratio=%d/%d\n", fat_free, super_t.num_data_blocks);
-	printf("rdir_free_ratio=%d/%d\n", rdir_free, FS_FILE_MAX_COUNT);
+	return ret;
+}
 
-	return 0;
+int fs_pread_ctx(fs_t *fs, int fd, void *buf, size_t count, size_t offset)
+{
+	struct op_probe probe;
+	stats_begin(&probe, FS_OP_READ);
+	int ret = file_pread(fs, fd, buf, count, offset);
+	stats_end(&probe, FS_OP_READ, ret);
+
+	return ret;
 }
 
-int fs_create(const char *filename)
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
 {
-	/* TODO: Phase 2 */
-	if (!filename)
+	return fs_pread_ctx(default_fs, fd, buf, count, offset);
+}
+
+/* Appends to a file by name, with the directory locked */
+int file_append(struct fs *fs, const char *filename, const void *buf, size_t count)
+{
+	if (!filename || strlen(filename) >= FS_FILENAME_LEN || count == 0 || count > INT_MAX || buf == NULL)
 	{
 		return -1;
 	}
 
-	if (strlen(filename) > FS_FILENAME_LEN)
+	int pos = dir_lookup(fs, filename);
+	if (pos == -1)
 	{
 		return -1;
 	}
 
-	int count = 0;
-	int i;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++){
-		/* Duplicate filename */
-		if (strcmp((char *)root_t.entries_root[i].filename, filename) == 0)
-		{
-			return -1;
-		}
-		/* Root directory already contains MAX files, Count numbers of file */
-		if (root_t.entries_root[i].filename[0] != '\0')
+	/* Descriptors open on the file may be using it */
+	pthread_rwlock_wrlock(&fs->file_locks[pos]);
+	uint8_t scratch[BLOCK_SIZE];
+	struct iovec iov = {.iov_base = (void *)buf, .iov_len = count};
+	int ret = write_at(fs, pos, scratch, &iov, 1, count, fs->root_t.entries_root[pos].file_size);
+	pthread_rwlock_unlock(&fs->file_locks[pos]);
+
+	return ret;
+}
+
+int fs_batch_ctx(fs_t *fs, struct fs_batch_op *ops, size_t count)
+{
+	if (fs == NULL || (ops == NULL && count > 0))
+	{
+		return -1;
+	}
+
+	/* The whole batch runs with the directory locked, then the metadata it changed is written once */
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	for (size_t i = 0; i < count; i++)
+	{
+		switch (ops[i].op)
 		{
-			count++;
+			case FS_BATCH_CREATE:
+				ops[i].ret = file_create(fs, ops[i].filename);
+				break;
+			case FS_BATCH_DELETE:
+				ops[i].ret = file_delete(fs, ops[i].filename);
+				break;
+			case FS_BATCH_WRITE:
+				ops[i].ret = file_append(fs, ops[i].filename, ops[i].buf, ops[i].count);
+				break;
+			default:
+				ops[i].ret = -1;
+				break;
 		}
 	}
 
-	if (count >= FS_FILE_MAX_COUNT)
+	pthread_mutex_lock(&fs->meta_lock);
+	int ret = sync_metadata(fs);
+	pthread_mutex_unlock(&fs->meta_lock);
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	return ret;
+}
+
+int fs_batch(struct fs_batch_op *ops, size_t count)
+{
+	return fs_batch_ctx(default_fs, ops, count);
+}
+
+/* Helper of fs_fallocate(), with the file and the metadata locked */
+int file_fallocate(struct fs *fs, int pos_entry, size_t length)
+{
+	size_t need = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (need == 0 || data_index(fs, pos_entry, (need - 1) * BLOCK_SIZE) != FAT_EOC)
+	{
+		return 0;
+	}
+
+	/* The block map now covers the whole chain, reserve the rest all or nothing */
+	struct block_map *map = &fs->block_maps[pos_entry];
+	size_t have = map->count;
+	if (need - have > fs->super_t.free_data_blocks)
 	{
 		return -1;
 	}
-	
-	/* Create a new empty file with default properties */
-	i = 0;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++)
+
+	uint16_t prev = have ? map->blocks[have - 1] : FAT_EOC;
+	for (size_t i = have; i < need; i++)
 	{
-		if (strcmp((char *)root_t.entries_root[i].filename, "") == 0)
+		long index = alloc_block(fs, prev, need - i);
+		if (index == -1)
 		{
-			memcpy((char *)root_t.entries_root[i].filename, filename, FS_FILENAME_LEN);
-			root_t.entries_root[i].file_size = 0;
-			root_t.entries_root[i].first_data_index = FAT_EOC;
-			break;
+			/* The free counter includes blocks whose freeing is not committed yet: give back what was reserved */
+			if (have == 0)
+			{
+				fs->root_t.entries_root[pos_entry].first_data_index = FAT_EOC;
+				fs->meta_dirty.root = 1;
+			}
+			else
+			{
+				fat_set(fs, map->blocks[have - 1], FAT_EOC);
+			}
+			for (size_t j = have; j < i; j++)
+			{
+				fat_set(fs, map->blocks[j], AVAILABLE);
+			}
+			pthread_mutex_lock(&fs->map_locks[pos_entry]);
+			map->count = have;
+			pthread_mutex_unlock(&fs->map_locks[pos_entry]);
+			return -1;
 		}
+		chain_append(fs, pos_entry, index);
+		prev = index;
 	}
 
 	return 0;
 }
 
-int fs_delete(const char *filename)
+int fs_fallocate_ctx(fs_t *fs, int fd, size_t length)
 {
-	/* TODO: Phase 2 */
-	if (!filename)
+	struct file *file = lock_file(fs, fd);
+	if (file == NULL)
 	{
 		return -1;
 	}
 
-	if (strlen(filename) > FS_FILENAME_LEN)
+	pthread_rwlock_wrlock(&fs->file_locks[file->pos_entry]);
+	pthread_mutex_lock(&fs->meta_lock);
+	int ret = file_fallocate(fs, file->pos_entry, length);
+	pthread_mutex_unlock(&fs->meta_lock);
+	pthread_rwlock_unlock(&fs->file_locks[file->pos_entry]);
+	pthread_mutex_unlock(&file->lock);
+
+	return ret;
+}
+
+int fs_fallocate(int fd, size_t length)
+{
+	return fs_fallocate_ctx(default_fs, fd, length);
+}
+
+/* Helper of fs_truncate(), with the file and the metadata locked */
+int file_truncate(struct fs *fs, int pos_entry, size_t length)
+{
+	struct entry *f_entry = &fs->root_t.entries_root[pos_entry];
+	if (length > f_entry->file_size)
 	{
 		return -1;
 	}
 
-	/* if the file is currently open */
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+	/* Cut the chain after the last block still needed */
+	size_t keep = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint16_t index;
+	if (keep == 0)
 	{
-		if(strcmp((char *)file_des_table.file_t[i].filename, filename) == 0)
-		{
-			return -1;
-		}
+		index = f_entry->first_data_index;
+		f_entry->first_data_index = FAT_EOC;
 	}
-
-	/* if there is no filename to delete */
-	int pos;
-	int check = 1;
-	for (pos = 0; pos < FS_FILE_MAX_COUNT; pos++)
-	{
-		/* Find corresponding index of the file in root dir */
-		if (strcmp((char *)root_t.entries_root[pos].filename, filename) == 0)
-		{	
-			check = 0;
-			break;
+	else
+	{
+		uint16_t last = data_index(fs, pos_entry, (keep - 1) * BLOCK_SIZE);
+		index = fs->fat_t.entries_fat[last];
+		if (index != FAT_EOC)
+		{
+			fat_set(fs, last, FAT_EOC);
 		}
 	}
 
-	if(check)
+	/* Free the tail, preallocated blocks included */
+	while (index != FAT_EOC && index < fs->super_t.num_data_blocks)
 	{
-		return -1;
+		uint16_t next_index = fs->fat_t.entries_fat[index];
+		fat_set(fs, index, AVAILABLE);
+		index = next_index;
 	}
-
-	/* Delethe filename from the root dir */
-	uint16_t data_index = root_t.entries_root[pos].first_data_index;
-	while (fat_t.entries_fat[data_index] != FAT_EOC)
+	pthread_mutex_lock(&fs->map_locks[pos_entry]);
+	if (fs->block_maps[pos_entry].count > keep)
 	{
-		uint16_t next_index = fat_t.entries_fat[data_index];
-		fat_t.entries_fat[data_index] = 0;
-		data_index = next_index;
+		fs->block_maps[pos_entry].count = keep;
 	}
-	fat_t.entries_fat[data_index] = 0;
-	struct entry empty_entry = {.filename = "", .file_size = 0, .first_data_index = FAT_EOC};
-	root_t.entries_root[pos] = empty_entry;
-	
+	pthread_mutex_unlock(&fs->map_locks[pos_entry]);
+
+	/* Offsets of other descriptors past the new end of the file are moved back on their next access */
+	f_entry->file_size = length;
+	fs->meta_dirty.root = 1;
+
 	return 0;
 }
 
-int fs_ls(void)
+int fs_truncate_ctx(fs_t *fs, int fd, size_t length)
 {
-	/* TODO: Phase 2 */
-	if (super_t.signature[0] == 0)
+	struct file *file = lock_file(fs, fd);
+	if (file == NULL)
 	{
 		return -1;
 	}
 
-	printf("FS Ls:\n");
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	pthread_rwlock_wrlock(&fs->file_locks[file->pos_entry]);
+	pthread_mutex_lock(&fs->meta_lock);
+	int ret = file_truncate(fs, file->pos_entry, length);
+	pthread_mutex_unlock(&fs->meta_lock);
+	pthread_rwlock_unlock(&fs->file_locks[file->pos_entry]);
+	if (ret == 0 && file->file_offset > length)
 	{
-		if (strcmp((char*) root_t.entries_root[i].filename, "") != 0)
-		{
-			printf("file: %s, size: %d, data_blk: %d\n", root_t.entries_root[i].filename, root_t.entries_root[i].file_size, root_t.entries_root[i].first_data_index);
-		}
+		file->file_offset = length;
 	}
+	pthread_mutex_unlock(&file->lock);
+
+	return ret;
+}
+
+int fs_truncate(int fd, size_t length)
+{
+	return fs_truncate_ctx(default_fs, fd, length);
+}
+
+int fs_cache_config(size_t nblocks)
+{
+	cache_blocks = nblocks;
 
 	return 0;
 }
 
-int fs_open(const char *filename)
+int fs_open_config(size_t max_open)
 {
-	/* TODO: Phase 3 */
-	if (!filename)
+	if (max_open == 0 || max_open > INT_MAX)
 	{
 		return -1;
 	}
 
-	if (strlen(filename) > FS_FILENAME_LEN)
+	open_max = max_open;
+
+	return 0;
+}
+
+int fs_journal_config(size_t nblocks, unsigned int interval_ms)
+{
+	if (nblocks > UINT16_MAX)
 	{
 		return -1;
 	}
 
-	/* no filename to open */
-	int no_file = 1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	journal_size = nblocks;
+	journal_interval = interval_ms;
+
+	return 0;
+}
+
+int fs_sched_config(unsigned int deadline_us)
+{
+	sched_deadline = deadline_us;
+
+	return 0;
+}
+
+int fs_trace_config(const char *filename)
+{
+	char *copy = NULL;
+
+	if (filename)
 	{
-		if (strcmp(filename, (const char *)root_t.entries_root[i].filename) == 0)
+		copy = strdup(filename);
+		if (!copy)
 		{
-			no_file = 0;
-			break;
+			return -1;
 		}
 	}
-	if (no_file)
-	{
-		return -1;
-	}
 
-	if (file_des_table.num_open_file >= FS_OPEN_MAX_COUNT)
-	{
-		return -1;
-	}
+	free(trace_file);
+	trace_file = copy;
+
+	return 0;
+}
 
-	size_t fd_id = 0;
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+int fs_backend_config(int backend)
+{
+	switch (backend)
 	{
-		/* find free index of file descriptor table which is file descriptor */
-		if (file_des_table.file_t[i].filename[0] == '\0')
-		{
-			memcpy(file_des_table.file_t[i].filename, filename, FS_FILENAME_LEN);
-			file_des_table.file_t[i].file_offset = 0;
-			fd_id = i;
-			file_des_table.num_open_file++;
+		case FS_BACKEND_FILE:
+			disk_backend = BLOCK_BACKEND_FILE;
 			break;
-		}
+		case FS_BACKEND_MMAP:
+			disk_backend = BLOCK_BACKEND_MMAP;
+			break;
+		case FS_BACKEND_URING:
+			disk_backend = BLOCK_BACKEND_URING;
+			break;
+		default:
+			return -1;
 	}
 
-	return (int) fd_id;
+	return 0;
 }
 
-int fs_close(int fd)
+int fs_cache_stats_ctx(fs_t *fs, size_t *hits, size_t *misses)
 {
-	/* TODO: Phase 3 */
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+	struct cache_stats stats;
+
+	if (fs == NULL || cache_get_stats(fs->cache, &stats) == -1)
 	{
 		return -1;
 	}
 
-	if (file_des_table.file_t[fd].filename[0] == '\0')
+	if (hits)
 	{
-		return -1;
+		*hits = stats.hits;
 	}
 
-	file_des_table.file_t[fd].filename[0] = '\0';
-	file_des_table.file_t[fd].file_offset = 0;
-	file_des_table.num_open_file--;
+	if (misses)
+	{
+		*misses = stats.misses;
+	}
 
 	return 0;
 }
 
-int fs_stat(int fd)
+int fs_cache_stats(size_t *hits, size_t *misses)
 {
-	/* TODO: Phase 3 */
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+	return fs_cache_stats_ctx(default_fs, hits, misses);
+}
+
+/* Count a run of @length free data blocks */
+void frag_free_run(struct fs_frag_stats *stats, size_t length)
+{
+	int bucket = 0;
+	while (bucket + 1 < FS_FRAG_BUCKETS && (length >> (bucket + 1)) != 0)
 	{
-		return -1;
+		bucket++;
 	}
 
-	char *name;
-	if (file_des_table.file_t[fd].filename[0] == '\0')
+	stats->free_runs++;
+	stats->free_hist[bucket]++;
+	if (length > stats->max_free_run)
+	{
+		stats->max_free_run = length;
+	}
+}
+
+int fs_frag_stats_ctx(fs_t *fs, struct fs_frag_stats *stats)
+{
+	if (fs == NULL || stats == NULL)
 	{
 		return -1;
 	}
-	else
+
+	memset(stats, 0, sizeof(*stats));
+
+	/* Chains and first blocks only change with the metadata locked, files only come and go with the directory locked */
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	pthread_mutex_lock(&fs->meta_lock);
+
+	int ret = 0;
+	for (int i = 0; ret == 0 && i < FS_FILE_MAX_COUNT; i++)
 	{
-		name = (char *)(file_des_table.file_t[fd].filename);
+		struct entry *f_entry = &fs->root_t.entries_root[i];
+		if (f_entry->filename[0] == '\0')
+		{
+			continue;
+		}
+
+		stats->files++;
+		size_t extents = 0, blocks = 0;
+		uint16_t prev = FAT_EOC;
+		for (uint16_t index = f_entry->first_data_index; index != FAT_EOC; index = fs->fat_t.entries_fat[index])
+		{
+			/* A chain that leaves the FAT or loops is corrupt */
+			if (index >= fs->super_t.num_data_blocks || ++blocks > fs->super_t.num_data_blocks)
+			{
+				ret = -1;
+				break;
+			}
+			if (prev == FAT_EOC || index != prev + 1)
+			{
+				extents++;
+			}
+			stats->file_blocks++;
+			prev = index;
+		}
+
+		stats->extents += extents;
+		if (extents > stats->max_extents)
+		{
+			stats->max_extents = extents;
+		}
 	}
 
-	int current_file_size = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	/* Runs of free blocks, in data block order */
+	size_t run = 0;
+	for (size_t i = 0; i < fs->super_t.num_data_blocks; i++)
 	{
-		if (strcmp((char *)root_t.entries_root[i].filename, name) == 0)
+		if (fs->fat_t.entries_fat[i] == AVAILABLE)
 		{
-			current_file_size = root_t.entries_root[i].file_size;
-			return current_file_size;
+			stats->free_blocks++;
+			run++;
 		}
+		else if (run != 0)
+		{
+			frag_free_run(stats, run);
+			run = 0;
+		}
+	}
+	if (run != 0)
+	{
+		frag_free_run(stats, run);
 	}
 
-	return current_file_size;
+	pthread_mutex_unlock(&fs->meta_lock);
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	return ret;
 }
 
-int fs_lseek(int fd, size_t offset)
+int fs_frag_stats(struct fs_frag_stats *stats)
 {
-	/* TODO: Phase 3 */
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+	return fs_frag_stats_ctx(default_fs, stats);
+}
+
+/* Limits of an fs_defrag() call */
+struct defrag_budget
+{
+	/* Blocks that can still be moved, SIZE_MAX if unlimited */
+	size_t blocks;
+	/* stats_clock() time to stop at, 0 if unlimited */
+	uint64_t deadline;
+	size_t moved;
+};
+
+int defrag_exhausted(const struct defrag_budget *budget)
+{
+	return budget->blocks == 0 || (budget->deadline != 0 && stats_clock() >= budget->deadline);
+}
+
+/*
+ * Helper of fs_defrag(): moves the nth block of a file to a free data block,
+ * with the directory and the file locked. The old block is left allocated to
+ * no file and added to released, see defrag_release(). Returns 1 if the
+ * target was taken in the meantime
+ */
+int defrag_move(struct fs *fs, int pos_entry, struct block_map *chain, size_t nth, uint16_t target, uint8_t *buf, struct block_map *released)
+{
+	uint16_t old = chain->blocks[nth];
+
+	/* Reserve the target first, so that writers to other files leave it alone while the data is copied */
+	pthread_mutex_lock(&fs->meta_lock);
+	if (freemap_first(&fs->free_map, target) != target)
 	{
-		return -1;
+		pthread_mutex_unlock(&fs->meta_lock);
+		return 1;
 	}
+	fat_set(fs, target, FAT_EOC);
+	pthread_mutex_unlock(&fs->meta_lock);
 
-	if (file_des_table.file_t[fd].filename[0] == '\0')
+	int ret = map_append(released, old);
+	if (ret == 0)
 	{
-		return -1;
+		ret = cache_read(fs->cache, old + fs->super_t.data_start_index, buf);
 	}
-
-	size_t current_file_size = fs_stat(fd);
-	if (offset > current_file_size)
+	if (ret == 0)
 	{
-		return -1;
+		ret = cache_write(fs->cache, target + fs->super_t.data_start_index, buf);
 	}
 
-	file_des_table.file_t[fd].file_offset = offset;
-
-	return 0;
-}
-
-/* Helper#1: Returns the index of the data block corresponding to the file's offset */
-uint16_t data_index(size_t offset, uint16_t f_start)
-{	
-	size_t counter = BLOCK_SIZE;
-	uint16_t ret_data_index = f_start;
-	while(ret_data_index != FAT_EOC && counter < offset)
+	/* Link the copy in place of the old block, the data is written back before the metadata that refers to it */
+	pthread_mutex_lock(&fs->meta_lock);
+	if (ret == -1)
 	{
-		if(fat_t.entries_fat[ret_data_index] == FAT_EOC)
-		{
-			return ret_data_index;
-		}
-		ret_data_index = fat_t.entries_fat[ret_data_index];
-		counter += BLOCK_SIZE;
+		fat_set(fs, target, AVAILABLE);
 	}
-
-	return ret_data_index;
-}
-/* finds first empty entry in FAT*/
-int first_fit() {
-	for(int i = 1; i < super_t.num_FAT_blocks* 2048; i++) {
-		if(fat_t.entries_fat[i] == AVAILABLE) {
-			return i;
+	else
+	{
+		fat_set(fs, target, fs->fat_t.entries_fat[old]);
+		if (nth == 0)
+		{
+			fs->root_t.entries_root[pos_entry].first_data_index = target;
+			fs->meta_dirty.root = 1;
 		}
-	}
-	return -1;
-}
-/* Gets the index of the file in the root directory*/
-int find_pos_entry(uint8_t * filename) {
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(strcmp((char *) filename, (char *)root_t.entries_root[i].filename) == 0)
+		else
 		{
-			return i;
+			fat_set(fs, chain->blocks[nth - 1], target);
 		}
+		/* Until the new chain is on disk, the old one may still be the one a crash leaves */
+		fat_set(fs, old, FAT_EOC);
 	}
-	return -1;
-}
-/* Write to a file */
-int fs_write(int fd, void *buf, size_t count) {
-	/* Error Checking */
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+	pthread_mutex_unlock(&fs->meta_lock);
+	if (ret == -1)
 	{
+		if (released->count > 0 && released->blocks[released->count - 1] == old)
+		{
+			released->count--;
+		}
 		return -1;
 	}
 
-	if (file_des_table.file_t[fd].filename[0] == '\0')
+	pthread_mutex_lock(&fs->map_locks[pos_entry]);
+	if (fs->block_maps[pos_entry].count > nth)
 	{
-		return -1;
+		fs->block_maps[pos_entry].blocks[nth] = target;
 	}
+	pthread_mutex_unlock(&fs->map_locks[pos_entry]);
+	chain->blocks[nth] = target;
+
+	return 0;
+}
 
-	if (count == 0)
+/* Helper of fs_defrag(): writes the moved chains to disk or to the journal, then frees the blocks they left, with the directory locked */
+int defrag_release(struct fs *fs, struct block_map *released)
+{
+	if (released->count == 0)
 	{
-		return -1;
+		return 0;
 	}
 
-	if (buf == NULL)
+	/* On failure the old blocks stay allocated to no file: lost space, but no file can be overwritten through them */
+	pthread_mutex_lock(&fs->meta_lock);
+	int ret = sync_metadata(fs);
+	if (ret == 0)
 	{
-		return -1;
+		for (size_t i = 0; i < released->count; i++)
+		{
+			fat_set(fs, released->blocks[i], AVAILABLE);
+		}
 	}
+	pthread_mutex_unlock(&fs->meta_lock);
+	released->count = 0;
 
-	/* Find correponding properties first */
-	uint8_t *f_filename = file_des_table.file_t[fd].filename;
-	size_t f_offset = file_des_table.file_t[fd].file_offset;
-	uint16_t data_block_index;
-
-	int pos_entry = find_pos_entry(f_filename); //get the entry in the root directory that is corresponding to filename 
-	uint16_t f_start = root_t.entries_root[pos_entry].first_data_index;
-	
-	if(f_start != FAT_EOC) { //written to before
-		data_block_index = data_index(f_offset, f_start) + super_t.data_start_index;
-	} else { 
-		data_block_index = first_fit() + super_t.data_start_index;
-	}
+	return ret;
+}
 
-	root_t.entries_root[pos_entry].first_data_index = abs(data_block_index - super_t.data_start_index);
+/*
+ * Helper of fs_defrag(): moves each extent of a file right after the previous
+ * one when there is room for it, with the directory and the file locked. The
+ * first extent moves to a free run that fits the whole file if the rest
+ * cannot follow it where it is
+ */
+int defrag_file(struct fs *fs, int pos_entry, struct defrag_budget *budget, uint8_t *buf, struct block_map *released)
+{
+	struct block_map chain = {0};
+	int ret = 0;
 
-	/* Bounce buffer */
-	void *bounce = malloc(BLOCK_SIZE);
-	void *temp = malloc(BLOCK_SIZE);	
-	int bytes_wrote = 0;
-	size_t count_check = BLOCK_SIZE;
-	size_t diff = 0;
-	uint16_t next_index;
-	
-	for(size_t i = 0; i <= count; i++) {
-		if(data_block_index >= super_t.data_start_index + super_t.num_data_blocks) {
-			fat_t.entries_fat[abs(data_block_index - super_t.data_start_index)] = FAT_EOC;
+	/* Only this file's chain is walked, but other entries of the FAT change under the metadata lock */
+	pthread_mutex_lock(&fs->meta_lock);
+	for (uint16_t index = fs->root_t.entries_root[pos_entry].first_data_index; index != FAT_EOC && index < fs->super_t.num_data_blocks && chain.count < fs->super_t.num_data_blocks; index = fs->fat_t.entries_fat[index])
+	{
+		if (map_append(&chain, index) == -1)
+		{
+			ret = -1;
 			break;
 		}
-		if(i == 0) {
-			if(block_read(data_block_index, temp) == -1) {
-				return -1;
-			}
-			memcpy(bounce, temp, BLOCK_SIZE);
-		}
-		if(i == 0 && count_check >= count) { //First and only block
-			diff = count;
-			memcpy(bounce + f_offset, buf, count);
-			bytes_wrote += diff;
-		}
-		else if(i == 0 && count_check < count) { //First block 
-			diff = BLOCK_SIZE;
-			memcpy(bounce + f_offset, buf, BLOCK_SIZE);
-			bytes_wrote += diff;
-		}
-		else if((size_t)bytes_wrote + BLOCK_SIZE >= count) { //Last block
-			diff = count - (count_check - BLOCK_SIZE);
-			memcpy(bounce, buf, diff);
-			bytes_wrote += diff;
-		}
-		else { //Middle blocks
-			diff = BLOCK_SIZE;
-			memcpy(bounce, buf, BLOCK_SIZE);
-			bytes_wrote += diff;
-			
-		}
+	}
+	pthread_mutex_unlock(&fs->meta_lock);
 
-		if(block_write(data_block_index, bounce) == -1) {
-			return -1;
+	size_t i = 0;
+	while (ret == 0 && i < chain.count)
+	{
+		size_t len = 1;
+		while (i + len < chain.count && chain.blocks[i + len] == chain.blocks[i + len - 1] + 1)
+		{
+			len++;
 		}
-		
-		f_offset = bytes_wrote; //changing the offset as we go
-		count_check += BLOCK_SIZE;
 
-		if((size_t)bytes_wrote == count) { //Done writing & set last data index to FAT_EOC so its not overwriiten when new files are added
-			fat_t.entries_fat[abs(data_block_index - super_t.data_start_index)] = FAT_EOC;
-			break;
+		long target = -1;
+		pthread_mutex_lock(&fs->meta_lock);
+		if (i == 0)
+		{
+			long next = chain.blocks[len - 1] + 1;
+			if (len < chain.count && freemap_first_run(&fs->free_map, next, chain.count - len) != next)
+			{
+				target = freemap_first_run(&fs->free_map, 1, chain.count);
+			}
 		}
-		
-		if(fat_t.entries_fat[abs(data_block_index - super_t.data_start_index)] == 0) { //expand blocks
-			fat_t.entries_fat[abs(data_block_index - super_t.data_start_index)] = FAT_EOC;
-			next_index = first_fit();
-			if(first_fit() == -1) //no more free data blocks
-				return bytes_wrote;
-		} else { //overwrite existing blocks
-			next_index = fat_t.entries_fat[abs(data_block_index - super_t.data_start_index)];
+		else
+		{
+			long next = chain.blocks[i - 1] + 1;
+			if (freemap_first_run(&fs->free_map, next, len) == next)
+			{
+				target = next;
+			}
 		}
+		pthread_mutex_unlock(&fs->meta_lock);
 
-		fat_t.entries_fat[abs(data_block_index - super_t.data_start_index)] = next_index;
-		data_block_index = next_index + super_t.data_start_index;
+		/* An extent moved partway leaves one more extent, the next call picks it up from there */
+		for (size_t k = 0; target != -1 && k < len; k++)
+		{
+			if (defrag_exhausted(budget))
+			{
+				ret = 1;
+				break;
+			}
+			ret = defrag_move(fs, pos_entry, &chain, i + k, target + k, buf, released);
+			if (ret != 0)
+			{
+				break;
+			}
+			budget->blocks--;
+			budget->moved++;
+		}
+		i += len;
 	}
-	file_des_table.file_t[fd].file_offset = f_offset;
-	root_t.entries_root[pos_entry].file_size = bytes_wrote;
-	free(bounce);
-	
-	return bytes_wrote;
+
+	free(chain.blocks);
+
+	return ret;
 }
 
-/* Read from a file */
-int fs_read(int fd, void *buf, size_t count)
+int fs_defrag_ctx(fs_t *fs, size_t max_blocks, unsigned int max_ms, struct fs_defrag_stats *stats)
 {
-	/* TODO: Phase 4 */
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
-	{
-		return -1;
-	}
+	struct fs_frag_stats frag;
+	struct defrag_budget budget = {
+		.blocks = max_blocks ? max_blocks : SIZE_MAX,
+		.deadline = max_ms ? stats_clock() + (uint64_t)max_ms * 1000000 : 0,
+	};
 
-	if (file_des_table.file_t[fd].filename[0] == '\0')
+	if (fs == NULL || (stats != NULL && fs_frag_stats_ctx(fs, &frag) == -1))
 	{
 		return -1;
 	}
-
-	if (count == 0)
+	if (stats != NULL)
 	{
-		return -1;
+		stats->extents_before = frag.extents;
 	}
 
+	uint8_t *buf = malloc(BLOCK_SIZE);
 	if (buf == NULL)
 	{
 		return -1;
 	}
-	
-	/* Find correponding properties first */
-	uint8_t *f_filename = file_des_table.file_t[fd].filename;
-	size_t f_offset = file_des_table.file_t[fd].file_offset;
-	/* Index of the first data block of the file */
-	uint16_t f_start;
-	int i = 0;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(strcmp((char *) f_filename, (char *)root_t.entries_root[i].filename) == 0)
-		{
-			f_start = root_t.entries_root[i].first_data_index;
-			break;
+
+	struct block_map released = {0};
+	pthread_mutex_lock(&fs->meta_lock);
+	int ret = (!fs->free_map.bits && build_free_map(fs) == -1) ? -1 : 0;
+	int pos = fs->defrag_next;
+	pthread_mutex_unlock(&fs->meta_lock);
+
+	/* One pass over the root directory, starting where the previous call stopped */
+	for (int n = 0; ret == 0 && n < FS_FILE_MAX_COUNT; n++)
+	{
+		pthread_rwlock_rdlock(&fs->dir_lock);
+		if (fs->root_t.entries_root[pos].filename[0] != '\0')
+		{
+			pthread_rwlock_wrlock(&fs->file_locks[pos]);
+			ret = defrag_file(fs, pos, &budget, buf, &released);
+			pthread_rwlock_unlock(&fs->file_locks[pos]);
+		}
+		pthread_rwlock_unlock(&fs->dir_lock);
+
+		/* A target taken by a concurrent writer only skips the rest of the file */
+		if (ret == 1 && !defrag_exhausted(&budget))
+		{
+			ret = 0;
+		}
+		if (ret == 0)
+		{
+			pos = (pos + 1) % FS_FILE_MAX_COUNT;
 		}
 	}
-	if(count > root_t.entries_root[i].file_size) {
-		count = root_t.entries_root[i].file_size;
+
+	/* The metadata of all the moved chains is written once, then the blocks they left are reusable */
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	if (defrag_release(fs, &released) == -1)
+	{
+		ret = -1;
 	}
-	/* Index of the data block corresponding to the file offset */
-	uint16_t data_block_index = data_index(f_offset, f_start) + super_t.data_start_index;
-	
-	void *bounce = malloc(BLOCK_SIZE);	
-	size_t count_check = BLOCK_SIZE;
-	size_t diff = 0;
-	size_t bytes_read = 0;
-	void *temp = malloc(BLOCK_SIZE);
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	pthread_mutex_lock(&fs->meta_lock);
+	fs->defrag_next = pos;
+	pthread_mutex_unlock(&fs->meta_lock);
+	free(released.blocks);
+	free(buf);
 
-	for(size_t i = 0; i <= count; i++) {
-		
-		if(block_read(data_block_index, bounce) == -1)
+	if (stats != NULL)
+	{
+		stats->blocks_moved = budget.moved;
+		if (fs_frag_stats_ctx(fs, &frag) == -1)
+		{
 			return -1;
-	
-		
-		if(i == 0 && count_check >= count) { //First and only block
-			memcpy(temp, bounce + f_offset, count);
-			diff = count;
-			bytes_read += count;
-		}
-		else if(i == 0 && count_check < count) { //First block to read 
-			memcpy(temp , bounce + f_offset, BLOCK_SIZE);
-			diff = BLOCK_SIZE;
-			bytes_read +=  diff;
-		}
-		else if(bytes_read + BLOCK_SIZE >= count) { //Last block
-			memcpy(temp, bounce, BLOCK_SIZE);
-			diff = count - (count_check - BLOCK_SIZE);
-			bytes_read += diff;
-			memcpy(buf + (i* BLOCK_SIZE), temp, diff);
-			break;
 		}
-		else { //Middle blocks
-			memcpy(temp, bounce, BLOCK_SIZE);
-			diff = BLOCK_SIZE;
-			bytes_read += diff;
-		}
-		f_offset = bytes_read;
-		memcpy(buf + (i*diff), temp, diff);	
+		stats->extents_after = frag.extents;
+	}
 
-		
-		if(bytes_read == count) {
-			break;	
-		}
+	return ret;
+}
+
+int fs_defrag(size_t max_blocks, unsigned int max_ms, struct fs_defrag_stats *stats)
+{
+	return fs_defrag_ctx(default_fs, max_blocks, max_ms, stats);
+}
 
-		count_check += BLOCK_SIZE;
+int fs_get_stats(struct fs_stats *stats)
+{
+	if (stats == NULL)
+	{
+		return -1;
+	}
 
-		/* Get next data block to be read*/
-		uint16_t next_index = fat_t.entries_fat[data_block_index - super_t.data_start_index];
-		data_block_index = next_index + super_t.data_start_index;
-		
+	/* Each counter is read atomically, a snapshot of all of them would need a lock on every operation */
+	size_t *from = (size_t *)&op_stats, *to = (size_t *)stats;
+	for (size_t i = 0; i < sizeof(op_stats) / sizeof(size_t); i++)
+	{
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
 	}
-	file_des_table.file_t[fd].file_offset = f_offset;
-	free(temp);
-	free(bounce);
 
-	return bytes_read;
-}
\ No newline at end of file
+	return 0;
+}
+
+int fs_reset_stats(void)
+{
+	size_t *counters = (size_t *)&op_stats;
+	for (size_t i = 0; i < sizeof(op_stats) / sizeof(size_t); i++)
+	{
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
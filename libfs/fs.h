@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,9 +10,37 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Default maximum number of open files, see fs_open_config() */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Default interval between two commits of the journal, in milliseconds */
+#define FS_JOURNAL_INTERVAL 100
+
+/** Operations counted by fs_get_stats() */
+#define FS_OP_MOUNT 0
+#define FS_OP_UMOUNT 1
+#define FS_OP_CREATE 2
+#define FS_OP_DELETE 3
+#define FS_OP_OPEN 4
+#define FS_OP_LSEEK 5
+#define FS_OP_READ 6
+#define FS_OP_WRITE 7
+/** Number of operations counted by fs_get_stats() */
+#define FS_OP_COUNT 8
+
+/** Number of buckets of the latency histograms, see fs_get_stats() */
+#define FS_LATENCY_BUCKETS 32
+
+/** Number of buckets of the free space histogram, see fs_frag_stats() */
+#define FS_FRAG_BUCKETS 16
+
+/** Virtual disk accessed with read and write system calls */
+#define FS_BACKEND_FILE 0
+/** Virtual disk mapped in memory */
+#define FS_BACKEND_MMAP 1
+/** Virtual disk accessed with batches of asynchronous requests (io_uring) */
+#define FS_BACKEND_URING 2
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,8 +49,15 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
- * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
+ * Once the file system is mounted, the other functions can be called by several
+ * threads at the same time: reads of the same or of different files proceed in
+ * parallel, writes exclude other accesses to the same file only. fs_mount(),
+ * fs_umount() and the configuration functions must not run concurrently with
+ * any other function.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid
+ * file system can be located, or if a journal cannot be replayed or set up
+ * (see fs_journal_config()). 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
@@ -36,6 +72,23 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write pending changes to disk
+ *
+ * Write the data blocks and the metadata (FAT and root directory blocks) that
+ * were modified since they were last written to the virtual disk. Blocks that
+ * did not change are not written. fs_umount() goes through the same path.
+ *
+ * When the virtual disk has a journal (see fs_journal_config()), the changes
+ * to the FAT and the root directory are committed to the journal instead,
+ * which is cheaper than writing the metadata blocks, and written to their
+ * actual location when the journal fills up and by fs_umount().
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if a block cannot be
+ * written. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -90,12 +143,13 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. A maximum of %FS_OPEN_MAX_COUNT files (or the limit set with
+ * fs_open_config()) can be open simultaneously. The lowest file descriptor
+ * that is not open is returned.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * or if the maximum number of files are currently open. Otherwise, return the
+ * file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -177,4 +231,441 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write() with the concatenation of the @iovcnt buffers of @iov,
+ * as a single operation: the file is looked up once, and each data block is
+ * written once even when several buffers share it.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @iovcnt is not positive, if a buffer is NULL, or if the buffers
+ * hold no data or more than %INT_MAX bytes. Otherwise return the number of
+ * bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read() into the concatenation of the @iovcnt buffers of @iov, as
+ * a single operation: the file is looked up once, and each data block is read
+ * once even when several buffers share it.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @iovcnt is not positive, if a buffer is NULL, or if the buffers
+ * hold no space or more than %INT_MAX bytes. Otherwise return the number of
+ * bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), but write at @offset and leave the file offset of file
+ * descriptor @fd unchanged. Positional reads and writes do not wait for one
+ * another on the descriptor, only on the file: threads sharing a descriptor
+ * can use them without fs_lseek().
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @buf is NULL or @count is 0, or if @offset is larger than the
+ * current file size. Otherwise return the number of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but read from @offset and leave the file offset of file
+ * descriptor @fd unchanged. Positional reads of the same file proceed in
+ * parallel, through the same descriptor or not.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @buf is NULL or @count is 0. Otherwise return the number of bytes
+ * actually read, 0 if @offset is at or past the end of the file.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_fallocate - Reserve data blocks for a file
+ * @fd: File descriptor
+ * @length: Number of bytes the file should be able to hold
+ *
+ * Allocate all the data blocks the file referenced by file descriptor @fd is
+ * missing to hold @length bytes, in a single pass and, when possible, as one
+ * contiguous run following the current last block of the file. The size of the
+ * file does not change: the reserved blocks are used by the following
+ * fs_write() operations that extend the file, and released by fs_truncate() or
+ * fs_delete().
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there are not enough free data blocks on disk, in which case no
+ * block is reserved. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t length);
+
+/**
+ * fs_truncate - Shrink a file
+ * @fd: File descriptor
+ * @length: New size of the file
+ *
+ * Set the size of the file referenced by file descriptor @fd to @length bytes
+ * and free all the data blocks past the new end of the file, including blocks
+ * reserved by fs_fallocate(). File offsets past the new end of the file are
+ * moved back to it.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @length is larger than the current file size. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t length);
+
+/** Batch operation creating a file, see fs_create() */
+#define FS_BATCH_CREATE 0
+/** Batch operation deleting a file, see fs_delete() */
+#define FS_BATCH_DELETE 1
+/** Batch operation appending data to a file, see fs_write() */
+#define FS_BATCH_WRITE 2
+
+/** Operation of a batch, see fs_batch() */
+struct fs_batch_op {
+	/** %FS_BATCH_CREATE, %FS_BATCH_DELETE or %FS_BATCH_WRITE */
+	int op;
+	/** Name of the file the operation applies to */
+	const char *filename;
+	/** Data appended to the file by %FS_BATCH_WRITE */
+	const void *buf;
+	size_t count;
+	/** Result of the operation, set by fs_batch() */
+	int ret;
+};
+
+/**
+ * fs_batch - Run a batch of operations
+ * @ops: Array of operations
+ * @count: Number of operations in @ops
+ *
+ * Run the operations of @ops in order, then write the data and metadata they
+ * modified to disk once, as fs_sync() does. Files are created and deleted as
+ * with fs_create() and fs_delete(), and %FS_BATCH_WRITE appends @count bytes of
+ * @buf to the end of the file without opening it. The result of each operation
+ * is stored in its @ret field: -1 on failure, 0 for a successful creation or
+ * deletion, and the number of bytes actually written for %FS_BATCH_WRITE. A
+ * failed operation does not stop the batch.
+ *
+ * Other threads cannot create, delete, open or list files while a batch runs.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @ops is NULL while
+ * @count is not 0, or if the modified blocks cannot be written. 0 otherwise,
+ * even if some operations failed.
+ */
+int fs_batch(struct fs_batch_op *ops, size_t count);
+
+/**
+ * fs_cache_config - Configure the block cache
+ * @nblocks: Maximum number of data blocks held in memory
+ *
+ * Set the size of the write-back block cache that data blocks go through. The
+ * new size takes effect at the next fs_mount(). Dirty blocks are written to
+ * disk when evicted, and at the latest by fs_umount(). A size of 0 disables the
+ * cache and makes every access go to the virtual disk.
+ *
+ * Return: 0.
+ */
+int fs_cache_config(size_t nblocks);
+
+/**
+ * fs_open_config - Set the maximum number of open files
+ * @max_open: Number of file descriptors
+ *
+ * Set the number of files that can be open simultaneously, %FS_OPEN_MAX_COUNT
+ * by default. The new limit takes effect at the next fs_mount().
+ *
+ * Return: -1 if @max_open is 0 or too large. 0 otherwise.
+ */
+int fs_open_config(size_t max_open);
+
+/**
+ * fs_journal_config - Configure the metadata journal
+ * @nblocks: Number of data blocks of the journal created at mount, 0 for none
+ * @interval_ms: Milliseconds between two commits, 0 to only commit in fs_sync()
+ *
+ * Without a journal, the changes to the FAT and the root directory stay in
+ * memory until fs_sync() or fs_umount(). With one, they are committed to it as
+ * compact records, every @interval_ms milliseconds by a background thread for
+ * all the operations of the interval at once, and by fs_sync(). Data blocks
+ * are written before the metadata that refers to them. The journal is written
+ * back to the FAT and root directory blocks (checkpointed) when it fills up,
+ * and by fs_umount(). fs_mount() replays the committed changes that were not
+ * checkpointed, after a crash for instance.
+ *
+ * A journal is set up by the next fs_mount() of a virtual disk that does not
+ * have one yet, over @nblocks free data blocks at the end of the disk (or the
+ * minimum needed by the size of the disk, if larger). It takes the form of a
+ * chain of data blocks that belongs to no file, and stays on the disk from
+ * then on. By default (@nblocks of 0), no journal is set up. The commit
+ * interval applies to the next fs_mount() of any disk that has a journal,
+ * %FS_JOURNAL_INTERVAL by default.
+ *
+ * Return: -1 if @nblocks is too large. 0 otherwise.
+ */
+int fs_journal_config(size_t nblocks, unsigned int interval_ms);
+
+/**
+ * fs_backend_config - Select how the virtual disk is accessed
+ * @backend: %FS_BACKEND_FILE, %FS_BACKEND_MMAP or %FS_BACKEND_URING
+ *
+ * Select the backend the virtual disk is opened with at the next fs_mount().
+ * By default, blocks are accessed with system calls (%FS_BACKEND_FILE). With
+ * %FS_BACKEND_MMAP, the whole virtual disk is mapped in memory: the FAT is used
+ * in place (or copied on journaled disks, so that changes only reach the disk
+ * once committed), data blocks bypass the block cache, and the mapping is
+ * flushed to the virtual disk file by fs_umount(). With %FS_BACKEND_URING, the
+ * blocks needed by a multi-block fs_read() are requested all at once through
+ * io_uring (or through system calls if the kernel does not support it).
+ *
+ * Return: -1 if @backend is invalid. 0 otherwise.
+ */
+int fs_backend_config(int backend);
+
+/**
+ * fs_sched_config - Set the dispatch deadline of the disk request scheduler
+ * @deadline_us: Microseconds a queued block request can wait for others
+ *
+ * The block cache writes dirty blocks back, and fs_sync() and fs_umount() write
+ * the metadata, through a scheduler that sorts the requests by block and
+ * merges consecutive blocks into single writes. A request is held back for at
+ * most @deadline_us microseconds for others to merge with, 1000 by default, or
+ * dispatched as soon as it is queued with a deadline of 0. The new deadline
+ * takes effect at the next fs_mount().
+ *
+ * Return: 0.
+ */
+int fs_sched_config(unsigned int deadline_us);
+
+/**
+ * fs_trace_config - Trace the block requests of the next mounts
+ * @filename: Name of the trace file, or NULL to stop tracing
+ *
+ * From the next fs_mount(), record every block read and write the file system
+ * makes in trace file @filename, overwritten at each mount and complete once
+ * unmounted. Requests are tagged with the operation that made them: FS_OP_xxx
+ * + 1, or 0 for the ones made in the background (cache write-back, readahead,
+ * journal commits). See block_trace_start() for the format of the records.
+ *
+ * Return: -1 if @filename cannot be copied. 0 otherwise.
+ */
+int fs_trace_config(const char *filename);
+
+/**
+ * fs_cache_stats - Get block cache counters
+ * @hits: Number of block accesses served by the cache (can be NULL)
+ * @misses: Number of block accesses that went to the disk (can be NULL)
+ *
+ * Return: -1 if no file system is currently mounted. 0 otherwise.
+ */
+int fs_cache_stats(size_t *hits, size_t *misses);
+
+/* Layout of the data blocks, see fs_frag_stats() */
+struct fs_frag_stats {
+	/* Files in the root directory */
+	size_t files;
+	/* Data blocks of the files, and runs of consecutive blocks they form */
+	size_t file_blocks;
+	size_t extents;
+	/* Largest number of runs of a single file */
+	size_t max_extents;
+	/* Free data blocks, runs of consecutive ones, and longest of these runs */
+	size_t free_blocks;
+	size_t free_runs;
+	size_t max_free_run;
+	/*
+	 * Number of free runs of 2^i to 2^(i+1) - 1 blocks in bucket i, the
+	 * last bucket also counts the longer runs
+	 */
+	size_t free_hist[FS_FRAG_BUCKETS];
+};
+
+/**
+ * fs_frag_stats - Measure the fragmentation of the file system
+ * @stats: Filled with the layout of the data blocks
+ *
+ * Walk the FAT chain of every file, counting the runs of consecutive data
+ * blocks (extents) each one is made of, and the runs of free data blocks.
+ * A file written in one go on a fresh file system has a single extent. The
+ * average extent length is @stats->file_blocks / @stats->extents.
+ *
+ * Return: -1 if no file system is currently mounted, if @stats is NULL, or if
+ * the FAT chain of a file is corrupt (goes past the data blocks or loops). 0
+ * otherwise.
+ */
+int fs_frag_stats(struct fs_frag_stats *stats);
+
+/* Outcome of a fs_defrag() call */
+struct fs_defrag_stats {
+	/* Extents of all the files before and after the call */
+	size_t extents_before;
+	size_t extents_after;
+	/* Data blocks relocated */
+	size_t blocks_moved;
+};
+
+/**
+ * fs_defrag - Make files contiguous, a step at a time
+ * @max_blocks: Largest number of blocks to move, 0 for no limit
+ * @max_ms: Milliseconds to stop after, 0 for no limit
+ * @stats: Filled with the extents before and after the call (can be NULL)
+ *
+ * Relocate the data blocks of fragmented files so that each extent follows
+ * the previous one, rewriting the FAT chain and the first data block of the
+ * files. A file moves as a whole to the first free run large enough for it
+ * when its blocks cannot be joined where they are; without such a run, only
+ * the extents that have room after the previous one move. Blocks are copied
+ * through the block cache and the file is locked while its blocks move, so
+ * that fs_defrag() can run on a mounted file system between other requests.
+ * The blocks the files leave are only freed at the end of the call, once the
+ * new chains are committed to the journal, or written home like fs_sync()
+ * does. On a virtual disk with a journal, a crash therefore leaves either the
+ * old or the new chain of a file intact. Without one, the FAT and the root
+ * directory reach the disk separately (and the FAT is modified in place with
+ * %FS_BACKEND_MMAP), so a crash during fs_defrag() can cut the files it moves.
+ *
+ * Each call resumes where the previous one stopped and returns once it went
+ * over every file or once it moved @max_blocks blocks or ran for @max_ms
+ * milliseconds, whichever comes first. Call it until it returns 0 to go over
+ * the whole file system. Filling @stats walks every FAT chain twice.
+ *
+ * Return: -1 if no file system is currently mounted, or if a block cannot be
+ * moved. 1 if the budget ran out first. 0 otherwise.
+ */
+int fs_defrag(size_t max_blocks, unsigned int max_ms, struct fs_defrag_stats *stats);
+
+/* Counters of one operation, see fs_get_stats() */
+struct fs_op_stats {
+	/* Calls, failed ones included */
+	size_t calls;
+	/* Bytes transferred (FS_OP_READ and FS_OP_WRITE only) */
+	size_t bytes;
+	/* Time spent in the calls, in nanoseconds */
+	size_t total_ns;
+	/* Blocks the calls read from and wrote to the virtual disk */
+	size_t block_reads;
+	size_t block_writes;
+	/*
+	 * Number of calls that took 2^i to 2^(i+1) - 1 nanoseconds in bucket
+	 * i, the last bucket also counts the longer calls
+	 */
+	size_t latency[FS_LATENCY_BUCKETS];
+};
+
+/* Counters of all the operations, indexed by FS_OP_xxx */
+struct fs_stats {
+	struct fs_op_stats ops[FS_OP_COUNT];
+};
+
+/**
+ * fs_get_stats - Get operation counters
+ * @stats: Filled with the counters of each operation
+ *
+ * Every call to fs_mount(), fs_umount(), fs_create(), fs_delete(), fs_open(),
+ * fs_lseek(), fs_read() and fs_write() is counted and timed, failed ones
+ * included (even without a mounted file system), along with the blocks of the
+ * virtual disk it reads and writes itself. fs_readv() and fs_pread() count as
+ * fs_read(), fs_writev() and fs_pwrite() as fs_write(),
+ * and each fs_*_ctx() function as the function it matches. Blocks transferred
+ * later on behalf of an operation are counted by the one that transfers them:
+ * fs_umount() for the dirty blocks of the cache and the metadata, nothing for
+ * the background readahead and journal threads. The counters are shared by
+ * all the file system instances and kept since the start of the process or
+ * the last fs_reset_stats(); updating them costs two clock reads per call.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_get_stats(struct fs_stats *stats);
+
+/**
+ * fs_reset_stats - Reset operation counters
+ *
+ * Set all the counters returned by fs_get_stats() back to 0.
+ *
+ * Return: 0.
+ */
+int fs_reset_stats(void);
+
+/*
+ * Instance API
+ *
+ * The functions above operate on a single default file system. Any number of
+ * file systems can be mounted at the same time as instances, each with its own
+ * virtual disk, block cache, FAT, root directory and file descriptors, and
+ * accessed with the fs_*_ctx() functions below. Instances share no state and
+ * no lock, so that different threads can serve different instances without
+ * contending. The configuration functions apply to the instances mounted
+ * after they are called.
+ */
+
+/** Mounted file system instance */
+typedef struct fs fs_t;
+
+/**
+ * fs_mount_ctx - Mount a file system instance
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as fs_mount(), without the limit of one mounted file system. Several
+ * instances must not be mounted on the same virtual disk file.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. Otherwise, return the file system instance.
+ */
+fs_t *fs_mount_ctx(const char *diskname);
+
+/**
+ * fs_umount_ctx - Unmount a file system instance
+ * @fs: File system instance
+ *
+ * Same as fs_umount(). Unless there are still open file descriptors or pending
+ * changes cannot be written, @fs is released even if -1 is returned, and must
+ * not be used anymore.
+ *
+ * Return: -1 if @fs is NULL, if there are still open file descriptors, or if
+ * the virtual disk cannot be written or closed. 0 otherwise.
+ */
+int fs_umount_ctx(fs_t *fs);
+
+/* Same as the functions without the _ctx suffix, on instance @fs (-1 if NULL) */
+int fs_sync_ctx(fs_t *fs);
+int fs_info_ctx(fs_t *fs);
+int fs_create_ctx(fs_t *fs, const char *filename);
+int fs_delete_ctx(fs_t *fs, const char *filename);
+int fs_ls_ctx(fs_t *fs);
+int fs_open_ctx(fs_t *fs, const char *filename);
+int fs_close_ctx(fs_t *fs, int fd);
+int fs_stat_ctx(fs_t *fs, int fd);
+int fs_lseek_ctx(fs_t *fs, int fd, size_t offset);
+int fs_write_ctx(fs_t *fs, int fd, void *buf, size_t count);
+int fs_read_ctx(fs_t *fs, int fd, void *buf, size_t count);
+int fs_writev_ctx(fs_t *fs, int fd, const struct iovec *iov, int iovcnt);
+int fs_readv_ctx(fs_t *fs, int fd, const struct iovec *iov, int iovcnt);
+int fs_pwrite_ctx(fs_t *fs, int fd, void *buf, size_t count, size_t offset);
+int fs_pread_ctx(fs_t *fs, int fd, void *buf, size_t count, size_t offset);
+int fs_fallocate_ctx(fs_t *fs, int fd, size_t length);
+int fs_truncate_ctx(fs_t *fs, int fd, size_t length);
+int fs_batch_ctx(fs_t *fs, struct fs_batch_op *ops, size_t count);
+int fs_cache_stats_ctx(fs_t *fs, size_t *hits, size_t *misses);
+int fs_frag_stats_ctx(fs_t *fs, struct fs_frag_stats *stats);
+int fs_defrag_ctx(fs_t *fs, size_t max_blocks, unsigned int max_ms, struct fs_defrag_stats *stats);
+
 #endif /* _FS_H */
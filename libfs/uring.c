@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+#define uring_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned wait_nr,
+			      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags,
+		       NULL, 0);
+}
+
+static void *ring_map(int fd, size_t len, off_t off)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, off);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+int uring_setup(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* Recent kernels map both rings at once */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz)
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		ring->cq_ring_sz = 0;
+	}
+
+	ring->sq_ring = ring_map(ring->fd, ring->sq_ring_sz, IORING_OFF_SQ_RING);
+	if (!ring->sq_ring)
+		goto err;
+
+	if (ring->cq_ring_sz) {
+		ring->cq_ring = ring_map(ring->fd, ring->cq_ring_sz,
+					 IORING_OFF_CQ_RING);
+		if (!ring->cq_ring)
+			goto err;
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+
+	ring->sqes = ring_map(ring->fd, ring->sqes_sz, IORING_OFF_SQES);
+	if (!ring->sqes)
+		goto err;
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+err:
+	uring_error("cannot map rings");
+	uring_teardown(ring);
+	return -1;
+}
+
+void uring_teardown(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+int uring_queue(struct uring *ring, int write_op, int fd,
+		const struct iovec *iov, int iovcnt, off_t off, uint64_t tag)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	if (tail - head >= *ring->sq_entries)
+		return -1;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write_op ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = off;
+	sqe->user_data = tag;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+
+	return 0;
+}
+
+int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+	unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+	for (;;) {
+		int ret = sys_io_uring_enter(ring->fd, ring->to_submit,
+					     wait_nr, flags);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* No room for more completions, they must be reaped first */
+			if (errno == EAGAIN || errno == EBUSY)
+				return 1;
+			perror("io_uring_enter");
+			return -1;
+		}
+
+		/* Nothing consumed: trying again right away would spin */
+		if (!ret && ring->to_submit)
+			return 1;
+
+		ring->to_submit -= ret;
+		if (!ring->to_submit)
+			return 0;
+	}
+}
+
+int uring_reap(struct uring *ring, uint64_t *tag, int *res)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+
+	if (head == tail)
+		return 0;
+
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*tag = cqe->user_data;
+	*res = cqe->res;
+
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
@@ -0,0 +1,88 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/types.h> /* for off_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
+
+/*
+ * <linux/io_uring.h> is only included by uring.c: it pulls <linux/fs.h> in,
+ * which has its own definition of BLOCK_SIZE
+ */
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* io_uring instance, driven with raw system calls */
+struct uring {
+	/* Ring file descriptor */
+	int fd;
+	/* Submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings of the rings */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	/* Entries queued but not submitted yet */
+	unsigned to_submit;
+};
+
+/**
+ * uring_setup - Create an io_uring instance
+ * @ring: Instance to set up
+ * @entries: Number of submission queue entries
+ *
+ * Return: -1 if the kernel does not support io_uring or if the rings cannot be
+ * mapped. 0 otherwise.
+ */
+int uring_setup(struct uring *ring, unsigned entries);
+
+/**
+ * uring_teardown - Destroy an io_uring instance
+ * @ring: Instance to destroy
+ */
+void uring_teardown(struct uring *ring);
+
+/**
+ * uring_queue - Queue a vectored read or write
+ * @ring: io_uring instance
+ * @write_op: Queue a write if non-zero, a read otherwise
+ * @fd: File to read from or write to
+ * @iov: Data buffers, transferred one after the other
+ * @iovcnt: Number of buffers in @iov
+ * @off: Offset in the file
+ * @tag: Value returned with the completion of the request
+ *
+ * The request is only handed to the kernel by the next uring_submit(). @iov
+ * must stay valid until the request completes.
+ *
+ * Return: -1 if the submission queue is full. 0 otherwise.
+ */
+int uring_queue(struct uring *ring, int write_op, int fd,
+		const struct iovec *iov, int iovcnt, off_t off, uint64_t tag);
+
+/**
+ * uring_submit - Submit the queued requests
+ * @ring: io_uring instance
+ * @wait_nr: Number of completions to wait for
+ *
+ * Return: -1 if the submission fails. 1 if the kernel takes no more requests
+ * until completions are reaped with uring_reap(), the others stay queued for
+ * the next call. 0 otherwise.
+ */
+int uring_submit(struct uring *ring, unsigned wait_nr);
+
+/**
+ * uring_reap - Get a completion
+ * @ring: io_uring instance
+ * @tag: Tag of the completed request
+ * @res: Result of the request (number of bytes or negated errno)
+ *
+ * Return: 0 if there is no completion available. 1 otherwise.
+ */
+int uring_reap(struct uring *ring, uint64_t *tag, int *res);
+
+#endif /* _URING_H */